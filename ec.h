@@ -183,6 +183,11 @@
 #define	SCI_EVENT_NUM_AUDIO_MUTE		0x2C	// Mute is on or off
 #define	SCI_EVENT_NUM_BLACK_SCREEN		0x2B	// Black screen is on or off
 
+/* bit of the event in the subscription mask of /dev/sci */
+#define	SCI_EVENT_NUM_BASE				0x20
+#define	SCI_EVENT_BIT(num)				(1U << ((num) - SCI_EVENT_NUM_BASE))
+#define	SCI_EVENT_MASK_ALL				0xffffffff
+
 #define	SCI_INDEX_LID					0x00
 #define	SCI_INDEX_DISPLAY_TOGGLE		0x01
 #define	SCI_INDEX_SLEEP					0x02
@@ -202,6 +207,32 @@
 
 #define	SCI_MAX_EVENT_COUNT			0x10
 
+/*
+ * sci event record, one for each sci event parsed. the records are kept
+ * in a ring by ec_sci, and seq is continuous, a gap in it means the
+ * records lost by overflow of the ring, or the records not subscribed
+ * by IOCTL_SCI_SET_MASK.
+ * read() on /dev/sci returns the records in this layout, several for
+ * one call if the buffer holds them.
+ */
+struct sci_event_record {
+	u64 time_ns;	/* monotonic time of the interrupt of the event */
+	u32 seq;		/* sequence number of the event */
+	u8	number;		/* SCI_EVENT_NUM_XXX */
+	u8	count;		/* events merged in the record, brightness & volume only */
+	u8	level;		/* brightness or volume level after the events */
+	u8	reserved;
+	u8	state[SCI_MAX_EVENT_COUNT];	/* indexed by SCI_INDEX_XXX */
+};
+
+/*
+ * /dev/sci ioctl operations, u32 mask of SCI_EVENT_BIT() for the file,
+ * the reader is only woken for the events in its mask, all by default.
+ */
+#define	SCI_IOC_MAGIC		'S'
+#define	IOCTL_SCI_SET_MASK	_IOW(SCI_IOC_MAGIC, 2, u32)
+#define	IOCTL_SCI_GET_MASK	_IOR(SCI_IOC_MAGIC, 3, u32)
+
 /* EC access port for sci communication */
 #define	EC_CMD_PORT		0x66
 #define	EC_STS_PORT		0x66
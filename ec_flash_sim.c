@@ -0,0 +1,419 @@
+/*
+ * EC(Embedded Controller) KB3310B flash simulator on Linux
+ *
+ * NOTE :
+ * 		Only built with -DEC_FLASH_SIM(make bench), linked into ec_miscd.
+ * 		1, index-io ports 0x381~0x383 reach a register file of 0xF000~0xFFFF.
+ * 		2, REG_XBISPIA0~REG_XBISPICFG2 drive a SPI NOR rom model with the
+ * 		   typical program, erase and status timing of the supported parts.
+ * 		3, port 0x66 takes the reset/idle mode and piece program commands.
+ * 		4, the FWH/LPC memory window shows the rom segment in REG_XBISEG0.
+ * 		All the port io, spi commands and udelay time are counted.
+ */
+
+/*******************************************************************/
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/delay.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/ktime.h>
+#include <asm/delay.h>
+
+#include "ec.h"
+#include "ec_misc.h"
+#define	EC_FLASH_SIM_CORE
+#include "ec_flash_sim.h"
+
+/*******************************************************************/
+
+/* 4Mbit rom as the real machine */
+#define	EC_SIM_ROM_SIZE		(512 * 1024)
+/* register file of ec */
+#define	EC_SIM_REG_BASE		0xF000
+#define	EC_SIM_REG_SIZE		0x1000
+
+/* typical timing of the rom parts */
+struct ec_sim_part {
+	const char *name;
+	unsigned char id[EC_ROM_ID_SIZE];
+	int sector_erase;			/* 4KB sector erase supported */
+	unsigned int program_us;	/* byte program */
+	unsigned int sector_ms;
+	unsigned int block_ms;
+	unsigned int chip_ms;
+	unsigned int status_ms;		/* status register write */
+};
+
+static const struct ec_sim_part ec_sim_parts[] = {
+	{ "SPANSION",	{ EC_ROM_PRODUCT_ID_SPANSION, 0x02, 0x12 },	0, 15, 0,  500, 3500, 50 },
+	{ "MXIC",		{ EC_ROM_PRODUCT_ID_MXIC, 0x20, 0x13 },		1, 9,  60, 700, 3500, 40 },
+	{ "AMIC",		{ EC_ROM_PRODUCT_ID_AMIC, 0x30, 0x13 },		1, 10, 90, 700, 4000, 15 },
+	{ "EONIC",		{ EC_ROM_PRODUCT_ID_EONIC, 0x31, 0x13 },	1, 10, 90, 500, 4000, 15 },
+};
+
+/* the part simulated, index of ec_sim_parts */
+static int sim_part = 1;
+module_param(sim_part, int, 0444);
+MODULE_PARM_DESC(sim_part, "simulated rom : 0 SPANSION, 1 MXIC, 2 AMIC, 3 EONIC");
+
+static struct ec_sim {
+	const struct ec_sim_part *part;
+	unsigned char *rom;
+	unsigned char reg[EC_SIM_REG_SIZE];
+	unsigned char port_high;
+	unsigned char port_low;
+
+	unsigned char status;		/* WEL and BP bits of rom */
+	ktime_t busy_until;			/* WIP is set until then */
+	int id_index;				/* next jedec id byte with cs held low */
+	ktime_t piece_until;		/* piece programming is done then */
+
+	spinlock_t lock;
+	struct ec_sim_stats stats;
+} ecsim;
+
+/*******************************************************************/
+
+static inline unsigned char *ec_sim_reg(unsigned short addr)
+{
+	return &ecsim.reg[addr - EC_SIM_REG_BASE];
+}
+
+static inline int ec_sim_busy(ktime_t until)
+{
+	return ktime_to_ns(ktime_sub(until, ktime_get())) > 0;
+}
+
+/* the rom is busy for us from now on */
+static void ec_sim_work(unsigned long us)
+{
+	ktime_t now = ktime_get();
+
+	if(!ec_sim_busy(ecsim.busy_until))
+		ecsim.busy_until = now;
+	ecsim.busy_until = ktime_add_ns(ecsim.busy_until, (u64)us * 1000);
+}
+
+/* erase the unit of size containing addr */
+static void ec_sim_erase(unsigned int addr, unsigned int size, unsigned int ms)
+{
+	addr &= ~(size - 1);
+	memset(ecsim.rom + addr, 0xff, size);
+	ec_sim_work(ms * 1000);
+}
+
+/*
+ * ec_sim_spi :
+ *	the command written to REG_XBISPICMD, the address and data are taken
+ *	from the XBI registers as the hardware does.
+ */
+static void ec_sim_spi(unsigned char cmd)
+{
+	const struct ec_sim_part *part = ecsim.part;
+	unsigned char *dat = ec_sim_reg(REG_XBISPIDAT);
+	unsigned char cfg = *ec_sim_reg(REG_XBISPICFG);
+	unsigned int addr;
+	int busy, writable;
+
+	ecsim.stats.spi_cmds++;
+	if(!(cfg & SPICFG_EN_SPICMD))
+		return;
+
+	/* jedec id is shifted out by the dummy commands with cs held low */
+	if(cfg & SPICFG_LOW_SPICS){
+		if(cmd == SPICMD_READ_ID)
+			ecsim.id_index = 0;
+		else
+			*dat = part->id[ecsim.id_index++ % EC_ROM_ID_SIZE];
+		return;
+	}
+
+	addr = (*ec_sim_reg(REG_XBISPIA2) << 16) | (*ec_sim_reg(REG_XBISPIA1) << 8)
+		| *ec_sim_reg(REG_XBISPIA0);
+	addr &= EC_SIM_ROM_SIZE - 1;
+	busy = ec_sim_busy(ecsim.busy_until);
+	writable = !busy && (ecsim.status & SPISTS_WEL);
+
+	switch(cmd){
+		case	SPICMD_READ_STATUS :
+				*dat = ecsim.status | (busy ? SPISTS_WIP : 0);
+				return;
+		case	SPICMD_WRITE_ENABLE :
+				if(!busy)
+					ecsim.status |= SPISTS_WEL;
+				return;
+		case	SPICMD_WRITE_DISABLE :
+				ecsim.status &= ~SPISTS_WEL;
+				return;
+		case	SPICMD_SST_EWSR :
+				return;
+		case	SPICMD_WRITE_STATUS :
+				if(writable){
+					ecsim.status = *dat & SPISTS_BP;
+					ec_sim_work(part->status_ms * 1000);
+				}
+				break;
+		case	SPICMD_READ_BYTE :
+		case	SPICMD_HIGH_SPEED_READ :
+		case	SPICMD_FRDO :
+				*dat = busy ? 0xff : ecsim.rom[addr];
+				return;
+		case	SPICMD_BYTE_PROGRAM :
+				if(writable && !(ecsim.status & SPISTS_BP)){
+					ecsim.rom[addr] &= *dat;
+					ec_sim_work(part->program_us);
+				}
+				break;
+		case	SPICMD_SST_SEC_ERASE :
+				if(writable && !(ecsim.status & SPISTS_BP) && part->sector_erase)
+					ec_sim_erase(addr, EC_SECTOR_SIZE, part->sector_ms);
+				break;
+		case	SPICMD_SST_BLK_ERASE :
+		case	SPICMD_BLK_ERASE :
+				if(writable && !(ecsim.status & SPISTS_BP))
+					ec_sim_erase(addr, EC_BLOCK_SIZE, part->block_ms);
+				break;
+		case	SPICMD_SST_CHIP_ERASE :
+		case	SPICMD_CHIP_ERASE :
+				if(writable && !(ecsim.status & SPISTS_BP))
+					ec_sim_erase(0, EC_SIM_ROM_SIZE, part->chip_ms);
+				break;
+		default :
+				return;
+	}
+
+	/* write enable latch is cleared by the write commands */
+	ecsim.status &= ~SPISTS_WEL;
+}
+
+/*
+ * ec_sim_piece :
+ *	the firmware burns the piece stored at PIECE_START_ADDR, the 64KB
+ *	block of it is erased for the first piece whatever the part is, as
+ *	ec_program_piece() assumes. it is done after the rom time passed.
+ */
+static void ec_sim_piece(void)
+{
+	const struct ec_sim_part *part = ecsim.part;
+	unsigned char *piece = ec_sim_reg(PIECE_START_ADDR);
+	unsigned int addr, i;
+	u64 us = 0;
+
+	addr = ((piece[1] << 16) | (piece[2] << 8) | piece[3]) & (EC_SIM_ROM_SIZE - 1);
+	if(addr > EC_SIM_ROM_SIZE - PIECE_SIZE)
+		addr = EC_SIM_ROM_SIZE - PIECE_SIZE;
+	if(piece[0] & FIRST_PIECE_YES){
+		memset(ecsim.rom + (addr & ~(EC_BLOCK_SIZE - 1)), 0xff, EC_BLOCK_SIZE);
+		us += part->block_ms * 1000;
+	}
+	for(i = 0; i < PIECE_SIZE; i++){
+		ecsim.rom[addr + i] &= piece[4 + i];
+		us += part->program_us;
+	}
+
+	*ec_sim_reg(PIECE_STATUS_REG) = 0x00;
+	ecsim.piece_until = ktime_add_ns(ktime_get(), us * 1000);
+}
+
+/* the command to 62/66 port */
+static void ec_sim_command(unsigned char cmd)
+{
+	unsigned char *mode = ec_sim_reg(REG_POWER_MODE);
+
+	switch(cmd){
+		case	CMD_INIT_RESET_MODE :
+				*mode = FLAG_RESET_MODE;
+				break;
+		case	CMD_INIT_IDLE_MODE :
+				*mode = FLAG_IDLE_MODE;
+				break;
+		case	CMD_EXIT_IDLE_MODE :
+				*mode = FLAG_NORMAL_MODE;
+				break;
+		case	CMD_PROGRAM_PIECE :
+				ec_sim_piece();
+				break;
+		default :
+				break;
+	}
+}
+
+static unsigned char ec_sim_reg_read(unsigned short addr)
+{
+	if(addr < EC_SIM_REG_BASE)
+		return 0xff;
+
+	switch(addr){
+		case	REG_XBISPICFG :
+				/* the spi transfer is finished at once */
+				return *ec_sim_reg(addr) & ~SPICFG_SPI_BUSY;
+		case	PIECE_STATUS_REG :
+				if(!ec_sim_busy(ecsim.piece_until))
+					return *ec_sim_reg(addr) | PIECE_STATUS_PROGRAM_DONE;
+				return *ec_sim_reg(addr);
+		default :
+				return *ec_sim_reg(addr);
+	}
+}
+
+static void ec_sim_reg_write(unsigned short addr, unsigned char val)
+{
+	if(addr < EC_SIM_REG_BASE)
+		return;
+
+	*ec_sim_reg(addr) = val;
+	if(addr == REG_XBISPICMD){
+		ec_sim_spi(val);
+	}else if( (addr == REG_PXCFG) && !(val & 0x01) ){
+		/* mcu released from reset */
+		*ec_sim_reg(REG_POWER_MODE) &= ~FLAG_RESET_MODE;
+	}
+}
+
+/*******************************************************************/
+
+unsigned char ec_sim_inb(unsigned long port)
+{
+	unsigned char val;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecsim.lock, flags);
+	ecsim.stats.port_io++;
+	switch(port){
+		case	EC_IO_PORT_HIGH :
+				val = ecsim.port_high;
+				break;
+		case	EC_IO_PORT_LOW :
+				val = ecsim.port_low;
+				break;
+		case	EC_IO_PORT_DATA :
+				val = ec_sim_reg_read((ecsim.port_high << 8) | ecsim.port_low);
+				break;
+		case	EC_STS_PORT :
+				/* input buffer is always empty */
+				val = 0x00;
+				break;
+		default :
+				val = 0xff;
+	}
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+
+	return val;
+}
+
+void ec_sim_outb(unsigned char val, unsigned long port)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecsim.lock, flags);
+	ecsim.stats.port_io++;
+	switch(port){
+		case	EC_IO_PORT_HIGH :
+				ecsim.port_high = val;
+				break;
+		case	EC_IO_PORT_LOW :
+				ecsim.port_low = val;
+				break;
+		case	EC_IO_PORT_DATA :
+				ec_sim_reg_write((ecsim.port_high << 8) | ecsim.port_low, val);
+				break;
+		case	EC_CMD_PORT :
+				ec_sim_command(val);
+				break;
+		default :
+				break;
+	}
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+}
+
+/*
+ * the FWH/LPC memory window, the rom itself stands for the mapping and
+ * the offset to it is the one in the window.
+ */
+void __iomem *ec_sim_lpc_map(unsigned long phys, unsigned long size)
+{
+	return (void __iomem *)ecsim.rom;
+}
+
+void ec_sim_lpc_read(void *dst, const void __iomem *src, size_t len)
+{
+	unsigned int offset = (const unsigned char __iomem *)src - (unsigned char __iomem *)ecsim.rom;
+	unsigned char *buf = dst;
+	unsigned int base;
+	unsigned long flags;
+	int open;
+
+	spin_lock_irqsave(&ecsim.lock, flags);
+	ecsim.stats.lpc_bytes += len;
+	/* the rom is not decoded while disabled or busy */
+	open = (*ec_sim_reg(REG_LPCCFG) & LPCCFG_EN_FWH) && !ec_sim_busy(ecsim.busy_until);
+	base = (*ec_sim_reg(REG_XBISEG0) * EC_LPC_WINDOW_SIZE) & (EC_SIM_ROM_SIZE - 1);
+	while(len--){
+		*buf++ = open ? ecsim.rom[(base + offset) & (EC_SIM_ROM_SIZE - 1)] : 0xff;
+		offset++;
+	}
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+}
+
+/* the real delay is kept for the timing of the rom model */
+void ec_sim_udelay(unsigned long us)
+{
+	unsigned long flags;
+
+	udelay(us);
+	spin_lock_irqsave(&ecsim.lock, flags);
+	ecsim.stats.busy_us += us;
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+}
+
+void ec_sim_get_stats(struct ec_sim_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecsim.lock, flags);
+	*stats = ecsim.stats;
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+}
+
+void ec_sim_reset_stats(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecsim.lock, flags);
+	memset(&ecsim.stats, 0, sizeof(struct ec_sim_stats));
+	spin_unlock_irqrestore(&ecsim.lock, flags);
+}
+
+int ec_sim_init(void)
+{
+	if( (sim_part < 0) || (sim_part >= ARRAY_SIZE(ec_sim_parts)) )
+		return -EINVAL;
+
+	spin_lock_init(&ecsim.lock);
+	ecsim.part = &ec_sim_parts[sim_part];
+	ecsim.rom = vmalloc(EC_SIM_ROM_SIZE);
+	if(ecsim.rom == NULL)
+		return -ENOMEM;
+	memset(ecsim.rom, 0xff, EC_SIM_ROM_SIZE);
+	memset(ecsim.reg, 0x00, EC_SIM_REG_SIZE);
+	/* FWH/LPC decoding is on as the firmware leaves it */
+	*ec_sim_reg(REG_LPCCFG) = LPCCFG_EN_FWH;
+	/* rom is protected after power on */
+	ecsim.status = SPISTS_BP;
+	ecsim.busy_until = ktime_get();
+	ecsim.piece_until = ecsim.busy_until;
+
+	printk(KERN_INFO "EC flash simulator : %s rom, %d KB.\n",
+			ecsim.part->name, EC_SIM_ROM_SIZE / 1024);
+
+	return 0;
+}
+
+void ec_sim_exit(void)
+{
+	vfree(ecsim.rom);
+	ecsim.rom = NULL;
+}
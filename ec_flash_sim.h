@@ -0,0 +1,42 @@
+/*
+ *	EC(Embedded Controller) KB3310B flash simulator include file
+ *
+ *	Built with -DEC_FLASH_SIM(make bench), all the port io and udelay of
+ *	ec_misc go to a software model of the KB3310B index-io, XBI and the
+ *	SPI NOR rom instead of the hardware, so the flashing can be measured
+ *	without risking a real machine.
+ */
+
+/* statistics of the simulator since the last reset */
+struct ec_sim_stats {
+	u64 port_io;	/* inb and outb */
+	u64 spi_cmds;	/* commands written to REG_XBISPICMD */
+	u64 busy_us;	/* time spent in udelay */
+	u64 lpc_bytes;	/* bytes read through the FWH/LPC window */
+};
+
+extern unsigned char ec_sim_inb(unsigned long port);
+extern void ec_sim_outb(unsigned char val, unsigned long port);
+extern void ec_sim_udelay(unsigned long us);
+extern void __iomem *ec_sim_lpc_map(unsigned long phys, unsigned long size);
+extern void ec_sim_lpc_read(void *dst, const void __iomem *src, size_t len);
+extern void ec_sim_get_stats(struct ec_sim_stats *stats);
+extern void ec_sim_reset_stats(void);
+extern int ec_sim_init(void);
+extern void ec_sim_exit(void);
+
+#ifndef	EC_FLASH_SIM_CORE
+#undef	inb
+#undef	outb
+#undef	udelay
+#undef	ioremap_nocache
+#undef	iounmap
+#undef	memcpy_fromio
+#define	inb(port)			ec_sim_inb(port)
+#define	outb(val, port)		ec_sim_outb(val, port)
+#define	udelay(us)			ec_sim_udelay(us)
+/* the FWH/LPC window is any non-zero lpc_window in the simulator */
+#define	ioremap_nocache(phys, size)		ec_sim_lpc_map(phys, size)
+#define	iounmap(addr)					do { } while(0)
+#define	memcpy_fromio(dst, src, len)	ec_sim_lpc_read(dst, src, len)
+#endif
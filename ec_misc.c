@@ -27,11 +27,21 @@
 #include <linux/kthread.h>
 #include <linux/delay.h>
 #include <linux/timer.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
+#include <linux/crc32.h>
+#include <linux/firmware.h>
+#include <linux/zlib.h>
 
 #include <asm/delay.h>
 
 #include "ec.h"
 #include "ec_misc.h"
+#ifdef	EC_FLASH_SIM
+#include "ec_flash_sim.h"
+#endif
 
 /*******************************************************************/
 /* open for using rom protection action */
@@ -41,8 +51,147 @@
 DEFINE_SPINLOCK(index_access_lock);
 /* this spinlock is dedicated for 62&66 ports access */
 DEFINE_SPINLOCK(port_access_lock);
-/* information used for programming */
-struct ec_info	ecinfo;
+/* the sleeping query holds the ports by this mutex and ec_query_busy */
+static DEFINE_MUTEX(ec_query_lock);
+static int ec_query_busy;
+/* this mutex serializes all the erasing and programming of ec rom */
+static DEFINE_MUTEX(ec_flash_lock);
+/* this mutex serializes the writers of the streaming job */
+static DEFINE_MUTEX(ec_stream_lock);
+
+/* opcode for reading rom, EC_READ_MODE_XXX, checked against the part at load */
+static int rom_read_mode = EC_READ_MODE_FAST;
+module_param(rom_read_mode, int, 0444);
+MODULE_PARM_DESC(rom_read_mode, "rom read mode : 0 normal, 1 fast read, 2 dual output fast read");
+
+/* update ec at load with EC_FW_NAME if its version is not the running one */
+static int fw_update;
+module_param(fw_update, int, 0444);
+MODULE_PARM_DESC(fw_update, "update ec firmware with " EC_FW_NAME " at load when the version differs");
+
+/*
+ * longest time of ec held by the IE programming before a break, 0 for no
+ * break. one break costs the idle mode exit and re-entry besides its
+ * EC_SLICE_BREAK_MS, about 2 to 3ms, see the "break" operation of the
+ * flashing benchmark. the breaks are taken at the sector boundaries, so
+ * the slice is one sector at least. the code is programmed in reset mode
+ * where the firmware never runs, so SCI waits for the whole code update.
+ */
+static int slice_us = 4000;
+module_param(slice_us, int, 0644);
+MODULE_PARM_DESC(slice_us, "max time in us of ec held by the IE programming between breaks, 0 for none, 4000 by default. no SCI is served while the code is programmed in reset mode");
+
+/* physical address of the FWH/LPC memory window of the rom, 0 for none */
+static unsigned long lpc_window;
+module_param(lpc_window, ulong, 0444);
+MODULE_PARM_DESC(lpc_window, "physical address of the FWH/LPC memory window for reading the rom");
+
+/* serve ec_rom_read from the shadow of the rom */
+static int rom_shadow = 1;
+module_param(rom_shadow, int, 0644);
+MODULE_PARM_DESC(rom_shadow, "keep the rom lines read in memory until they are erased or programmed");
+
+/* the rom part, the smallest erase unit is different between the manufacturers */
+struct ec_rom_part {
+	unsigned char id;			/* manufacturer id */
+	const char *name;
+	unsigned char erase_cmd;	/* command for the smallest erase unit */
+	unsigned int erase_size;
+	int dual;					/* SPICMD_FRDO is supported */
+};
+
+static const struct ec_rom_part ec_rom_parts[] = {
+	{ EC_ROM_PRODUCT_ID_SPANSION,	"SPANSION",	SPICMD_BLK_ERASE,		EC_BLOCK_SIZE,	0 },
+	{ EC_ROM_PRODUCT_ID_MXIC,		"MXIC",		SPICMD_SST_SEC_ERASE,	EC_SECTOR_SIZE,	0 },
+	{ EC_ROM_PRODUCT_ID_AMIC,		"AMIC",		SPICMD_SST_SEC_ERASE,	EC_SECTOR_SIZE,	1 },
+	{ EC_ROM_PRODUCT_ID_EONIC,		"EONIC",	SPICMD_SST_SEC_ERASE,	EC_SECTOR_SIZE,	1 },
+};
+/* block erase and the normal & fast read are supported by all the parts */
+static const struct ec_rom_part ec_rom_part_unknown = {
+	0x00, "UNKNOWN", SPICMD_BLK_ERASE, EC_BLOCK_SIZE, 0
+};
+static const struct ec_rom_part *ec_rom_part = &ec_rom_part_unknown;
+static unsigned char ec_rom_id[EC_ROM_ID_SIZE];
+
+/*
+ * shadow of the rom for ec_rom_read, a line is filled by the first read
+ * and dropped by the erasing and programming of this driver, which all
+ * run with ec_flash_lock held as the reading does.
+ */
+static unsigned char *ec_shadow;
+/* programming mode entered and the start of its current slice */
+static int ec_slice_flag = PROGRAM_FLAG_NONE;
+/* the mode ec is kept in after a failed stream, see ec_program_hold() */
+static int ec_program_held = PROGRAM_FLAG_NONE;
+static ktime_t ec_slice_start;
+/* lpc_window mapped */
+static void __iomem *ec_lpc;
+/* the reading may put ec in idle mode on the first miss, see ec_lpc_begin() */
+static int ec_lpc_allow;
+/* ec is put in idle mode for reading through the window */
+static int ec_lpc_idle;
+/* the window matches the spi reading or not, 0 not checked, 1 ok, -1 broken */
+static int ec_lpc_state;
+static unsigned char ec_lpc_check[EC_SHADOW_LINE];
+static DECLARE_BITMAP(ec_shadow_valid, EC_SHADOW_LINES);
+
+/* one page of the image for streaming programming */
+struct ec_chunk {
+	unsigned char *buf;
+	u32 len;
+	int full;
+};
+
+/* the programming job, only one job can be running at a time */
+struct ec_job {
+	struct work_struct work;
+	struct ec_info info;
+	/* the image is the data of fw loaded by request_firmware */
+	const struct firmware *fw;
+	int flag;
+	/* jiffies when the job is submitted */
+	unsigned long start;
+
+	/* journaled mode : programmed sector by sector */
+	int journaled;
+	struct ec_journal journal;
+	/* erase steps of the job */
+	struct ec_erase_plan plan;
+
+	/* streaming mode : the image comes from write() page by page */
+	int stream;
+	struct file *owner;
+	struct ec_chunk chunk[EC_STREAM_CHUNKS];
+	int fill;		/* next chunk for the writer */
+	int drain;		/* next chunk for the worker */
+	u32 received;	/* bytes accepted from the writer */
+	u32 limit;		/* bytes the writer can give */
+	int zlib;		/* the stream is zlib compressed */
+	int abort;
+
+	/* status lock & wait_queue for the completion */
+	spinlock_t lock;
+	wait_queue_head_t wq;
+	struct ec_job_status status;
+};
+static struct ec_job ecjob;
+/* status of the last finished jobs by id % EC_JOB_HISTORY, under ecjob.lock */
+static struct ec_job_status ec_job_history[EC_JOB_HISTORY];
+static struct workqueue_struct *ec_flash_wq;
+/* journal given by IOCTL_JOURNAL_SET for resuming the next job */
+static struct ec_journal ec_journal_resume;
+/* firmware identity, refreshed by the worker at load and after programming */
+static struct ec_identity ec_ident;
+static DEFINE_SPINLOCK(ec_ident_lock);
+static struct delayed_work ec_ident_work;
+/* cached copy of the IE record store, dropped when IE is programmed */
+static unsigned char ec_ie_cache[IE_STORE_SIZE];
+static int ec_ie_cache_valid;
+static void ec_job_phase(u32 phase);
+static void ec_job_progress(u32 done);
+static void ec_program_end(int flag);
+static void ec_ident_invalidate(void);
+static void ec_ident_refresh(unsigned int delay_ms);
 
 /*******************************************************************/
 
@@ -78,9 +227,55 @@ void ec_write(unsigned short addr, unsigned char val)
 }
 EXPORT_SYMBOL_GPL(ec_write);
 
+/*
+ * ec_read_multi :
+ *	read count registers in one pass of index-io, the high port is
+ *	only written when the high byte of the address changes.
+ */
+void ec_read_multi(const unsigned short *addr, unsigned char *val, int count)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&index_access_lock, flags);
+	for(i = 0; i < count; i++){
+		if( (i == 0) || ((addr[i] ^ addr[i - 1]) & 0xff00) )
+			outb( (addr[i] & 0xff00) >> 8, EC_IO_PORT_HIGH );
+		outb( (addr[i] & 0x00ff), EC_IO_PORT_LOW );
+		val[i] = inb(EC_IO_PORT_DATA);
+	}
+	spin_unlock_irqrestore(&index_access_lock, flags);
+}
+EXPORT_SYMBOL_GPL(ec_read_multi);
+
+/*
+ * ec_write_block :
+ *	write len bytes to the continuous EC registers or ram with one lock,
+ *	the high address port is only refilled when it is changed.
+ */
+static void ec_write_block(unsigned short addr, const unsigned char *buf, unsigned int len)
+{
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&index_access_lock, flags);
+	for(i = 0; i < len; i++, addr++){
+		if( (i == 0) || ((addr & 0x00ff) == 0) )
+			outb( (addr & 0xff00) >> 8, EC_IO_PORT_HIGH );
+		outb( (addr & 0x00ff), EC_IO_PORT_LOW );
+		outb( buf[i], EC_IO_PORT_DATA );
+	}
+	inb( EC_IO_PORT_DATA );	// flush the write action
+	spin_unlock_irqrestore(&index_access_lock, flags);
+}
+
 /*
  * ec_query_seq
  * this function is used for ec command writing and the corresponding status query 
+ * the irqs are disabled for the whole query, the callers which can sleep
+ * should use ec_query_seq_sleep() instead.
+ * NOTE : the atomic callers can not wait for a sleeping query, -EBUSY is
+ * returned at once while one holds the ports.
  */
 int ec_query_seq(unsigned char cmd)
 {
@@ -90,6 +285,11 @@ int ec_query_seq(unsigned char cmd)
 	int ret = 0;
 
 	spin_lock_irqsave(&port_access_lock, flags);
+	if(ec_query_busy){
+		spin_unlock_irqrestore(&port_access_lock, flags);
+		PRINTK_DBG(KERN_ERR "EC QUERY SEQ : ports held by a sleeping query.\n");
+		return -EBUSY;
+	}
 
 	/* make chip goto reset mode */
 	udelay(EC_REG_DELAY);
@@ -122,6 +322,126 @@ int ec_query_seq(unsigned char cmd)
 
 EXPORT_SYMBOL_GPL(ec_query_seq);
 
+/* the delay between the polls of ec, the cpu is given away meanwhile */
+static inline void ec_poll_sleep(unsigned int us)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	usleep_range(us, us + us / 2);
+#else
+	udelay(us);
+	cond_resched();
+#endif
+}
+
+/* hold the ports for a sleeping query, the irqs are kept enabled */
+static void ec_query_hold(void)
+{
+	unsigned long flags;
+
+	might_sleep();
+	mutex_lock(&ec_query_lock);
+	spin_lock_irqsave(&port_access_lock, flags);
+	ec_query_busy = 1;
+	spin_unlock_irqrestore(&port_access_lock, flags);
+}
+
+static void ec_query_release(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&port_access_lock, flags);
+	ec_query_busy = 0;
+	spin_unlock_irqrestore(&port_access_lock, flags);
+	mutex_unlock(&ec_query_lock);
+}
+
+/* issue the command with the ports held by ec_query_hold() */
+static int ec_query_cmd_sleep(unsigned char cmd)
+{
+	int timeout;
+	unsigned char status;
+	int ret = 0;
+
+	ec_poll_sleep(EC_REG_DELAY);
+	outb(cmd, EC_CMD_PORT);
+	ec_poll_sleep(EC_REG_DELAY);
+
+	/* check if the command is received by ec */
+	timeout = EC_CMD_TIMEOUT;
+	status = inb(EC_STS_PORT);
+	while(timeout--){
+		if(status & (1 << 1)){
+			ec_poll_sleep(EC_REG_DELAY);
+			status = inb(EC_STS_PORT);
+			continue;
+		}
+		break;
+	}
+
+	if(timeout <= 0){
+		printk(KERN_ERR "EC QUERY SEQ : deadable error : timeout...\n");
+		ret = -EINVAL;
+	}else{
+		PRINTK_DBG(KERN_INFO "(%x/%d)ec issued command %x status : 0x%x\n", timeout, EC_CMD_TIMEOUT - timeout, cmd, status);
+	}
+
+	return ret;
+}
+
+/*
+ * ec_query_seq_sleep :
+ *	the same query as ec_query_seq() for the process context, the ports
+ *	are held without disabling irqs and ec is polled with sleeping.
+ */
+int ec_query_seq_sleep(unsigned char cmd)
+{
+	int ret;
+
+	ec_query_hold();
+	ret = ec_query_cmd_sleep(cmd);
+	ec_query_release();
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ec_query_seq_sleep);
+
+/*
+ * ec_query_read_sleep :
+ *	issue the command and read the byte ec answers on the data port,
+ *	the ports are held across both so no other query comes between.
+ */
+int ec_query_read_sleep(unsigned char cmd, unsigned char *val)
+{
+	int timeout = EC_OBF_TIMEOUT;
+	unsigned char status;
+	int ret;
+
+	ec_query_hold();
+	ret = ec_query_cmd_sleep(cmd);
+	if(ret < 0)
+		goto out;
+
+	/* wait for the output buffer full */
+	ec_poll_sleep(EC_REG_DELAY);
+	status = inb(EC_STS_PORT);
+	while( !(status & (1 << 0)) && (--timeout > 0) ){
+		ec_poll_sleep(EC_REG_DELAY);
+		status = inb(EC_STS_PORT);
+	}
+	if(!(status & (1 << 0))){
+		PRINTK_DBG(KERN_ERR "EC QUERY READ : no answer to command %x.\n", cmd);
+		ret = -EINVAL;
+		goto out;
+	}
+	*val = inb(EC_DAT_PORT);
+	ec_poll_sleep(EC_REG_DELAY);
+
+out :
+	ec_query_release();
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ec_query_read_sleep);
+
 /************************************************************************/
 
 /* enable the chip reset mode */
@@ -132,7 +452,7 @@ static int ec_init_reset_mode(void)
 	int ret = 0;
 	
 	/* make chip goto reset mode */
-	ret = ec_query_seq(CMD_INIT_RESET_MODE);
+	ret = ec_query_seq_sleep(CMD_INIT_RESET_MODE);
 	if(ret < 0){
 		printk(KERN_ERR "ec init reset mode failed.\n");
 		goto out;
@@ -143,11 +463,11 @@ static int ec_init_reset_mode(void)
 	status = ec_read(REG_POWER_MODE) & FLAG_RESET_MODE;
 	while(timeout--){
 		if(status){
-			udelay(EC_REG_DELAY);
+			ec_poll_sleep(EC_REG_DELAY);
 			break;
 		}
 		status = ec_read(REG_POWER_MODE) & FLAG_RESET_MODE;
-		udelay(EC_REG_DELAY);
+		ec_poll_sleep(EC_REG_DELAY);
 	}
 	if(timeout <= 0){
 		printk(KERN_ERR "ec rom fixup : can't check reset status.\n");
@@ -236,18 +556,18 @@ static int ec_init_idle_mode(void)
 	unsigned char status = 0;
 	int ret = 0;
 
-	ec_query_seq(CMD_INIT_IDLE_MODE);
+	ec_query_seq_sleep(CMD_INIT_IDLE_MODE);
 
 	/* make the action take active */
 	timeout = EC_CMD_TIMEOUT;
 	status = ec_read(REG_POWER_MODE) & FLAG_IDLE_MODE;
 	while(timeout--){
 		if(status){
-			udelay(EC_REG_DELAY);
+			ec_poll_sleep(EC_REG_DELAY);
 			break;
 		}
 		status = ec_read(REG_POWER_MODE) & FLAG_IDLE_MODE;
-		udelay(EC_REG_DELAY);
+		ec_poll_sleep(EC_REG_DELAY);
 	}
 	if(timeout <= 0){
 		printk(KERN_ERR "ec rom fixup : can't check out the status.\n");
@@ -265,7 +585,7 @@ static int ec_init_idle_mode(void)
 static int ec_exit_idle_mode(void)
 {
 
-	ec_query_seq(CMD_EXIT_IDLE_MODE);
+	ec_query_seq_sleep(CMD_EXIT_IDLE_MODE);
 
 	PRINTK_DBG(KERN_INFO "exit idle mode ok...................\n");
 	
@@ -342,6 +662,32 @@ static inline int ec_flash_busy(unsigned long timeout)
 	return EC_STATE_IDLE;
 }
 
+/*
+ * ec_rom_wait_status :
+ *	poll the rom status register until all the bits in mask are cleared,
+ *	sleeping between polls. The spi access should be started already.
+ */
+static int ec_rom_wait_status(unsigned char mask, unsigned int timeout_ms, unsigned char *status)
+{
+	unsigned long expire = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned char val;
+
+	while(1){
+		ec_write(REG_XBISPICMD, SPICMD_READ_STATUS);
+		if(ec_instruction_cycle() < 0){
+			return -EINVAL;
+		}
+		val = ec_read(REG_XBISPIDAT);
+		if(status)
+			*status = val;
+		if(!(val & mask))
+			return 0;
+		if(time_after(jiffies, expire))
+			return -ETIMEDOUT;
+		msleep(EC_STATUS_POLL_INTERVAL);
+	}
+}
+
 static int rom_instruction_cycle(unsigned char cmd)
 {
 	unsigned long timeout = 0;
@@ -381,6 +727,18 @@ static int rom_instruction_cycle(unsigned char cmd)
 	if(timeout < EC_SPICMD_STANDARD_TIMEOUT)
 			timeout = EC_SPICMD_STANDARD_TIMEOUT;
 
+	/* erase and status writing last ms to seconds, sleep while polling */
+	if(timeout >= EC_SPICMD_SLEEP_TIMEOUT){
+		if( ec_instruction_cycle() < 0 ){
+			return EC_STATE_BUSY;
+		}
+		if(ec_rom_wait_status(SPISTS_WIP, timeout / 1000, NULL) < 0){
+			printk(KERN_ERR "ROM_INSTRUCTION_CYCLE : timeout for cmd 0x%x.\n", cmd);
+			return EC_STATE_BUSY;
+		}
+		return EC_STATE_IDLE;
+	}
+
 	return ec_flash_busy(timeout);
 }
 
@@ -413,48 +771,269 @@ static void ec_stop_spi(void)
 	delay_spi(SPI_FINISH_WAIT_TIME);
 }
 
-/* read one byte from xbi interface */
-static int ec_read_byte(unsigned int addr, unsigned char *byte)
+/*
+ * ec_read_seq :
+ *	read len bytes from rom sequentially within one spi session.
+ *	no write enable is needed for reading, and the address registers
+ *	are only refilled when their bytes are changed.
+ */
+static int ec_read_seq(unsigned int addr, unsigned char *buf, unsigned int len)
 {
-	int ret = 0;
+	unsigned int prev = ~addr;
+	unsigned char cmd, cfg;
+	int i, ret = 0;
+
+	switch(rom_read_mode){
+		case	EC_READ_MODE_NORMAL :
+				cmd = SPICMD_READ_BYTE;
+				break;
+		case	EC_READ_MODE_DUAL :
+				cmd = SPICMD_FRDO;
+				break;
+		default :
+				cmd = SPICMD_HIGH_SPEED_READ;
+	}
 
 	/* enable spicmd writing. */
 	ec_start_spi();
-
-	/* enable write spi flash */
-	ec_write(REG_XBISPICMD, SPICMD_WRITE_ENABLE);
-	if(rom_instruction_cycle(SPICMD_WRITE_ENABLE) == EC_STATE_BUSY){
-			printk(KERN_ERR "EC_READ_BYTE : SPICMD_WRITE_ENABLE failed.\n");
-			ret = -EINVAL;
-			goto out;
-	}
-	
-	/* write the address */
-	ec_write(REG_XBISPIA2, (addr & 0xff0000) >> 16);
-	ec_write(REG_XBISPIA1, (addr & 0x00ff00) >> 8);
-	ec_write(REG_XBISPIA0, (addr & 0x0000ff) >> 0);
-	/* start action */
-	ec_write(REG_XBISPICMD, SPICMD_HIGH_SPEED_READ);
-	if(rom_instruction_cycle(SPICMD_HIGH_SPEED_READ) == EC_STATE_BUSY){
-			printk(KERN_ERR "EC_READ_BYTE : SPICMD_HIGH_SPEED_READ failed.\n");
+	cfg = ec_read(REG_XBISPICFG);
+	/* the high speed read goes as the original code, only the dual
+	 * output read needs the fast read cycle of xbi */
+	if(cmd == SPICMD_FRDO)
+		ec_write(REG_XBISPICFG, cfg | SPICFG_EN_FAST_READ);
+
+	for(i = 0; i < len; i++, addr++){
+		/* write the address */
+		if( (addr ^ prev) & 0xff0000 )
+			ec_write(REG_XBISPIA2, (addr & 0xff0000) >> 16);
+		if( (addr ^ prev) & 0x00ff00 )
+			ec_write(REG_XBISPIA1, (addr & 0x00ff00) >> 8);
+		ec_write(REG_XBISPIA0, (addr & 0x0000ff) >> 0);
+		prev = addr;
+
+		/* start action */
+		ec_write(REG_XBISPICMD, cmd);
+		if(ec_instruction_cycle() < 0){
+			printk(KERN_ERR "EC_READ_SEQ : read cmd 0x%x failed at 0x%x.\n", cmd, addr);
 			ret = -EINVAL;
-			goto out;
+			break;
+		}
+		buf[i] = ec_read(REG_XBISPIDAT);
 	}
-	
-	*byte = ec_read(REG_XBISPIDAT);
 
-out :
+	ec_write(REG_XBISPICFG, cfg);
 	/* disable spicmd writing. */
 	ec_stop_spi();
 
 	return ret;
 }
 
+/*
+ * ec_lpc_read :
+ *	read the rom by the memory cycles of the FWH/LPC window instead of
+ *	one spi command per byte. REG_XBISEG0 selects the 64KB segment in
+ *	the window and is restored at last. the segment can't be switched
+ *	under the running firmware, so the window is only used while ec is
+ *	in idle mode, and the decoding is disabled in reset mode. -EAGAIN is
+ *	returned for the spi reading then.
+ *	the window is trusted after its first line matches the spi reading.
+ */
+static int ec_lpc_read(unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	unsigned int offset, count, check = min_t(unsigned int, len, EC_SHADOW_LINE);
+	unsigned char seg;
+	int ret;
+
+	if( (ec_lpc == NULL) || (ec_lpc_state < 0) )
+		return -ENODEV;
+	if( !ec_lpc_idle && (ec_slice_flag != PROGRAM_FLAG_IE) )
+		return -EAGAIN;
+	if(!(ec_read(REG_LPCCFG) & LPCCFG_EN_FWH))
+		return -EAGAIN;
+
+	if(ec_lpc_state == 0){
+		ret = ec_read_seq(addr, ec_lpc_check, check);
+		if(ret < 0)
+			return ret;
+	}
+
+	seg = ec_read(REG_XBISEG0);
+	for(offset = 0; offset < len; offset += count){
+		count = min_t(unsigned int, len - offset,
+				EC_LPC_WINDOW_SIZE - (addr + offset) % EC_LPC_WINDOW_SIZE);
+		ec_write(REG_XBISEG0, (addr + offset) / EC_LPC_WINDOW_SIZE);
+		memcpy_fromio(buf + offset, ec_lpc + (addr + offset) % EC_LPC_WINDOW_SIZE, count);
+	}
+	ec_write(REG_XBISEG0, seg);
+
+	if(ec_lpc_state == 0){
+		if(memcmp(buf, ec_lpc_check, check)){
+			printk(KERN_WARNING "EC misc : FWH/LPC window differs from the rom, not used.\n");
+			ec_lpc_state = -1;
+			return -EIO;
+		}
+		ec_lpc_state = 1;
+	}
+
+	return 0;
+}
+
+/*
+ * ec_lpc_begin :
+ *	a reading of len bytes starts, ec may be put in idle mode for the
+ *	window when the reading misses the shadow. ec_lpc_end() takes ec back.
+ */
+static void ec_lpc_begin(unsigned int len)
+{
+	if( ec_lpc && (ec_lpc_state >= 0) && (len >= EC_LPC_MIN_READ) )
+		ec_lpc_allow = 1;
+}
+
+/* put ec in idle mode, only tried once for the reading */
+static void ec_lpc_enter(void)
+{
+	ec_lpc_allow = 0;
+	if( (ec_slice_flag != PROGRAM_FLAG_NONE) || (ec_program_held != PROGRAM_FLAG_NONE) )
+		return;
+
+	if(ec_init_idle_mode() < 0){
+		ec_exit_idle_mode();
+		return;
+	}
+	ec_disable_WDD();
+	ec_lpc_idle = 1;
+}
+
+static void ec_lpc_end(void)
+{
+	ec_lpc_allow = 0;
+	if(!ec_lpc_idle)
+		return;
+	ec_lpc_idle = 0;
+	ec_exit_idle_mode();
+	ec_enable_WDD();
+}
+
+/* read the rom in bulk, by the FWH/LPC window if it can be used */
+static int ec_rom_fetch(unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	if(ec_lpc_allow)
+		ec_lpc_enter();
+	if(ec_lpc_read(addr, buf, len) == 0)
+		return 0;
+
+	return ec_read_seq(addr, buf, len);
+}
+
+/* read one byte from xbi interface */
+static inline int ec_read_byte(unsigned int addr, unsigned char *byte)
+{
+	return ec_read_seq(addr, byte, 1);
+}
+
+/* drop the shadow lines of len bytes from addr, the rom there is changing */
+static void ec_shadow_invalidate(unsigned int addr, unsigned int len)
+{
+	unsigned int line;
+
+	if( (len == 0) || (addr >= EC_FLASH_SIZE) )
+		return;
+	if(len > EC_FLASH_SIZE - addr)
+		len = EC_FLASH_SIZE - addr;
+	for(line = addr / EC_SHADOW_LINE; line <= (addr + len - 1) / EC_SHADOW_LINE; line++)
+		clear_bit(line, ec_shadow_valid);
+}
+
+/* read through the shadow, the missed lines are read from rom as a whole */
+static int ec_shadow_read(unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	unsigned int line, offset, count;
+	unsigned char *shadow;
+	int ret;
+
+	while(len){
+		line = addr / EC_SHADOW_LINE;
+		offset = addr % EC_SHADOW_LINE;
+		count = min_t(unsigned int, len, EC_SHADOW_LINE - offset);
+		shadow = ec_shadow + line * EC_SHADOW_LINE;
+
+		if(!test_bit(line, ec_shadow_valid)){
+			ret = ec_rom_fetch(line * EC_SHADOW_LINE, shadow, EC_SHADOW_LINE);
+			if(ret < 0)
+				return ret;
+			set_bit(line, ec_shadow_valid);
+		}
+		memcpy(buf, shadow + offset, count);
+
+		addr += count;
+		buf += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+/* ec_rom_read() with ec_flash_lock held */
+static int ec_rom_read_locked(unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	if( rom_shadow && ec_shadow && (addr < EC_FLASH_SIZE) && (len <= EC_FLASH_SIZE - addr) )
+		return ec_shadow_read(addr, buf, len);
+
+	return ec_rom_fetch(addr, buf, len);
+}
+
+/*
+ * ec_rom_read :
+ *	read the rom content out, it is not mixed with the programming.
+ *	the lines read once are served from the shadow.
+ */
+int ec_rom_read(unsigned int addr, unsigned char *buf, unsigned int len)
+{
+	int ret;
+
+	if(mutex_lock_interruptible(&ec_flash_lock))
+		return -ERESTARTSYS;
+	ec_lpc_begin(len);
+	ret = ec_rom_read_locked(addr, buf, len);
+	ec_lpc_end();
+	mutex_unlock(&ec_flash_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ec_rom_read);
+
+/* crc32 in the same way as zlib, so it can be checked on the host */
+static inline u32 ec_crc32(u32 crc, const unsigned char *buf, unsigned int len)
+{
+	return crc32(crc ^ ~0U, buf, len) ^ ~0U;
+}
+
+/* crc32 of the rom content continued from *crc, should be called with ec_flash_lock */
+static int ec_rom_crc(unsigned int addr, unsigned int len, u32 *crc)
+{
+	unsigned char buf[64];
+	unsigned int count;
+	int ret;
+
+	while(len){
+		count = min_t(unsigned int, len, sizeof(buf));
+		ret = ec_rom_fetch(addr, buf, count);
+		if(ret < 0)
+			return ret;
+		*crc = ec_crc32(*crc, buf, count);
+		addr += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
 /* write one byte to ec rom */
 static int ec_write_byte(unsigned int addr, unsigned char byte)
 {
 	int ret = 0;
 
+	ec_shadow_invalidate(addr, 1);
 	/* enable spicmd writing. */
 	ec_start_spi();
 
@@ -528,51 +1107,68 @@ static int EC_ROM_unprotect(void)
 	return 0;
 }
 
-/* erase one block or chip or sector as needed */
-static int ec_unit_erase(unsigned char erase_cmd, unsigned int addr)
+#ifdef EC_ROM_PROTECTION
+/*
+ * ec_rom_unprotect_wait :
+ *	unprotect the rom and wait until the BP bits are really cleared,
+ *	it should be called within the spi session.
+ */
+static int ec_rom_unprotect_wait(void)
 {
 	unsigned char status;
-	int ret = 0, i = 0;
 	int unprotect_count = 3;
-	int check_flag =0;
-
-	/* enable spicmd writing. */
-	ec_start_spi();
+	unsigned int timeout;
 
-#ifdef EC_ROM_PROTECTION
 	/* added for re-check SPICMD_READ_STATUS */
 	while(unprotect_count-- > 0){
 		if(EC_ROM_unprotect()){
-			ret = -EINVAL;
-			goto out;
+			return -EINVAL;
 		}
-		
-		for(i = 0; i < ((2 - unprotect_count) * 100 + 10); i++)	//first time:500ms --> 5.5sec -->10.5sec
-			udelay(50000);
-		ec_write(REG_XBISPICMD, SPICMD_READ_STATUS);
-		if(rom_instruction_cycle(SPICMD_READ_STATUS) == EC_STATE_BUSY){
-			printk(KERN_ERR "EC_PROGRAM_ROM : SPICMD_READ_STATUS failed.\n");
-		} else {
-			status = ec_read(REG_XBISPIDAT);
-			PRINTK_DBG(KERN_INFO "Read unprotect status : 0x%x\n", status);
-			if((status & 0x1C) == 0x00){
-				PRINTK_DBG(KERN_INFO "Read unprotect status OK1 : 0x%x\n", status & 0x1C);
-				check_flag = 1;
-				break;
-			}
-		}	
-	}
 
-	if(!check_flag){
-		printk(KERN_INFO "SPI ROM unprotect fail.\n");
-		return 1;
+		/* poll WIP and BP bits, at most 500ms --> 5.5sec --> 10.5sec */
+		timeout = EC_UNPROTECT_TIMEOUT + (2 - unprotect_count) * EC_UNPROTECT_RETRY_STEP;
+		if(ec_rom_wait_status(SPISTS_WIP | SPISTS_BP, timeout, &status) == 0){
+			PRINTK_DBG(KERN_INFO "Read unprotect status OK1 : 0x%x\n", status & SPISTS_BP);
+			return 0;
+		}
+		PRINTK_DBG(KERN_INFO "Read unprotect status : 0x%x\n", status);
 	}
+
+	printk(KERN_INFO "SPI ROM unprotect fail.\n");
+	return -EINVAL;
+}
 #endif
 
-	/* block address fill */
-	if(erase_cmd == SPICMD_BLK_ERASE){
-		ec_write(REG_XBISPIA2, (addr & 0x00ff0000) >> 16);
-		ec_write(REG_XBISPIA1, (addr & 0x0000ff00) >> 8);
+/* erase one block or chip or sector as needed */
+static int ec_unit_erase(unsigned char erase_cmd, unsigned int addr)
+{
+	int ret = 0;
+
+	switch(erase_cmd){
+		case	SPICMD_SEC_ERASE :
+		case	SPICMD_SST_SEC_ERASE :
+				ec_shadow_invalidate(addr & ~(EC_SECTOR_SIZE - 1), EC_SECTOR_SIZE);
+				break;
+		case	SPICMD_BLK_ERASE :
+		case	SPICMD_SST_BLK_ERASE :
+				ec_shadow_invalidate(addr & ~(EC_BLOCK_SIZE - 1), EC_BLOCK_SIZE);
+				break;
+		default :
+				ec_shadow_invalidate(0, EC_FLASH_SIZE);
+	}
+	/* enable spicmd writing. */
+	ec_start_spi();
+
+#ifdef EC_ROM_PROTECTION
+	ret = ec_rom_unprotect_wait();
+	if(ret)
+		goto out;
+#endif
+
+	/* block or sector address fill */
+	if( (erase_cmd != SPICMD_CHIP_ERASE) && (erase_cmd != SPICMD_SST_CHIP_ERASE) ){
+		ec_write(REG_XBISPIA2, (addr & 0x00ff0000) >> 16);
+		ec_write(REG_XBISPIA1, (addr & 0x0000ff00) >> 8);
 		ec_write(REG_XBISPIA0, (addr & 0x000000ff) >> 0);
 	}
 
@@ -591,32 +1187,34 @@ out :
 	return ret;
 }
 
-/* update the whole rom content with H/W mode
- * PLEASE USING ec_unit_erase() FIRSTLY
+/*
+ * ec_program_enter :
+ *	make ec goto the proper mode for programming.
+ *	the code is burned with ec in reset mode, and IE with ec in idle mode
+ *	and WDD disabled. ec_program_end() should be called at last.
  */
-static int ec_program_rom(struct ec_info *info, int flag)
+static int ec_program_enter(int flag)
 {
-	unsigned int addr = 0;
-	unsigned long size = 0;
-	unsigned char *ptr = NULL;
-	unsigned char data;
-	unsigned char val = 0;
 	int ret = 0;
-	int i, j;
-	unsigned char status;
+
+	/* ec is still in the mode held by the failed stream */
+	if(ec_program_held != PROGRAM_FLAG_NONE){
+		if(ec_program_held != flag)
+			return -EBUSY;
+		ec_program_held = PROGRAM_FLAG_NONE;
+		goto out;
+	}
 
 	/* modify for program serial No, set IE_START_ADDR and use idle mode, disable WDD */
 	if (flag == PROGRAM_FLAG_ROM) {
 		ret = ec_init_reset_mode();
-		addr = info->start_addr + EC_START_ADDR;
 		PRINTK_DBG(KERN_INFO "PROGRAM_FLAG_ROM..............\n");
 	} else if (flag == PROGRAM_FLAG_IE) {
 		ret = ec_init_idle_mode();
 		ec_disable_WDD();
-		addr = info->start_addr + IE_START_ADDR;
 		PRINTK_DBG(KERN_INFO "PROGRAM_FLAG_IE..............\n");
 	} else {
-		return 0;
+		return -EINVAL;
 	}
 
 	if(ret < 0){
@@ -624,21 +1222,316 @@ static int ec_program_rom(struct ec_info *info, int flag)
 			ec_enable_WDD();
 		return ret;
 	}
+out :
+	ec_slice_flag = flag;
+	ec_slice_start = ktime_get();
+
+	return 0;
+}
+
+/*
+ * ec_program_hold :
+ *	the rom is left erased or half written by the failed programming, and
+ *	ec would run the broken code once it exits reset mode. so ec is kept
+ *	in reset mode, the next programming job goes on from there and the
+ *	ec_program_end() of it brings ec back.
+ */
+static void ec_program_hold(int flag)
+{
+	ec_slice_flag = PROGRAM_FLAG_NONE;
+	ec_program_held = flag;
+	printk(KERN_CRIT "program ec : image is incomplete, ec is held in reset mode until programmed again.\n");
+}
+
+/* leave the programming mode, or hold ec in it when the code is broken */
+static void ec_program_finish(int flag, int ret)
+{
+	if( ret && (flag == PROGRAM_FLAG_ROM) )
+		ec_program_hold(flag);
+	else
+		ec_program_end(flag);
+}
+
+/*
+ * ec_program_enter_unprotect :
+ *	enter the programming mode and unprotect the rom, for writing
+ *	without erasing should also go to the unprotected rom.
+ */
+static int ec_program_enter_unprotect(int flag)
+{
+	int held = (ec_program_held == flag);
+	int ret;
+
+	ret = ec_program_enter(flag);
+	if(ret < 0)
+		return ret;
+
+#ifdef EC_ROM_PROTECTION
+	ec_start_spi();
+	ret = ec_rom_unprotect_wait();
+	ec_stop_spi();
+	if(ret){
+		/* the code left broken by the former job is not run either */
+		ec_program_finish(flag, held ? ret : 0);
+		return ret;
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * ec_program_break :
+ *	give ec EC_SLICE_BREAK_MS of running its firmware in the middle of
+ *	the IE programming to serve the queued SCI and battery & fan work,
+ *	and take it back to idle mode. the programming can't go on out of
+ *	idle mode, so the re-entry is retried before giving up.
+ */
+static int ec_program_break(void)
+{
+	int i, ret = 0;
+
+	ec_exit_idle_mode();
+	ec_enable_WDD();
+	for(i = 0; i < EC_SLICE_RETRY; i++){
+		msleep(EC_SLICE_BREAK_MS);
+		ret = ec_init_idle_mode();
+		if(ret == 0)
+			break;
+	}
+	ec_disable_WDD();
+	if(ret < 0)
+		printk(KERN_ERR "program ec : back to idle mode failed.\n");
+
+	return ret;
+}
+
+/*
+ * ec_program_yield :
+ *	called at the unit boundaries of the programming, ec is given a
+ *	break once the slice is used up. the code can't run in reset mode,
+ *	so only the cpu is given to the others there.
+ */
+static int ec_program_yield(void)
+{
+	int ret = 0;
+
+	if( (slice_us <= 0) || (ec_slice_flag == PROGRAM_FLAG_NONE) )
+		return 0;
+	if(ktime_us_delta(ktime_get(), ec_slice_start) < slice_us)
+		return 0;
+
+	if(ec_slice_flag == PROGRAM_FLAG_IE)
+		ret = ec_program_break();
+	else
+		cond_resched();
+	ec_slice_start = ktime_get();
+
+	return ret;
+}
+
+/* class of the erase unit against the image */
+#define	EC_UNIT_CLEAN		0	// same as the image
+#define	EC_UNIT_PROGRAM		1	// only 1 bits to be cleared, programming is enough
+#define	EC_UNIT_DIRTY		2	// should be erased
+
+/* compare the rom with the image, return EC_UNIT_XXX */
+static int ec_unit_class(unsigned int addr, const u8 *buf, unsigned int len)
+{
+	unsigned char val[64];
+	unsigned int count, i;
+	int cls = EC_UNIT_CLEAN;
+
+	for(; len; addr += count, buf += count, len -= count){
+		count = min_t(unsigned int, len, sizeof(val));
+		if(ec_read_seq(addr, val, count) < 0)
+			return EC_UNIT_DIRTY;
+		for(i = 0; i < count; i++){
+			if(val[i] == buf[i])
+				continue;
+			if( (val[i] & buf[i]) != buf[i] )
+				return EC_UNIT_DIRTY;
+			cls = EC_UNIT_PROGRAM;
+		}
+	}
+
+	return cls;
+}
+
+/* bytes to be programmed in the erased unit */
+static unsigned int ec_unit_bytes(const u8 *buf, unsigned int len)
+{
+	unsigned int i, n = 0;
+
+	for(i = 0; i < len; i++){
+		if(buf[i] != 0xff)
+			n++;
+	}
+
+	return n;
+}
+
+static void ec_plan_add(struct ec_erase_plan *plan, u32 cmd, u32 addr, u32 size, u32 est_ms)
+{
+	struct ec_erase_step *step = &plan->step[plan->steps];
+
+	step->cmd = cmd;
+	step->addr = addr;
+	step->size = size;
+	step->est_ms = est_ms;
+	step->actual_ms = 0;
+	plan->est_ms += est_ms;
+	plan->steps++;
+}
+
+/*
+ * ec_erase_plan :
+ *	classify the erase units covering [addr, addr + size) into cls[], and
+ *	choose the erase steps with the least typical time. buf is NULL if the
+ *	image is not known in advance, then all the units are dirty.
+ *	the units erased by a block erase are marked dirty for programming.
+ */
+static void ec_erase_plan(struct ec_erase_plan *plan, unsigned int addr, unsigned int size,
+		const u8 *buf, u8 *cls)
+{
+	unsigned int unit = ec_rom_part->erase_size;
+	unsigned int base = addr - (addr % unit);
+	unsigned int end = addr + size;
+	unsigned int a, b, lo, hi, n, dirty, extra_us;
+	unsigned long flags;
+
+	memset(plan, 0, sizeof(struct ec_erase_plan));
+
+	for(a = base, n = 0; a < end; a += unit, n++){
+		lo = max(a, addr);
+		hi = min(a + unit, end);
+		cls[n] = buf ? ec_unit_class(lo, buf + (lo - addr), hi - lo) : EC_UNIT_DIRTY;
+	}
+
+	for(b = base - (base % EC_BLOCK_SIZE); b < end; b += EC_BLOCK_SIZE){
+		dirty = 0;
+		extra_us = 0;
+		for(a = max(b, base); (a < b + EC_BLOCK_SIZE) && (a < end); a += unit){
+			n = (a - base) / unit;
+			if(cls[n] == EC_UNIT_DIRTY){
+				dirty++;
+			}else{
+				/* the clean units have to be programmed again after block erase */
+				lo = max(a, addr);
+				hi = min(a + unit, end);
+				extra_us += ec_unit_bytes(buf + (lo - addr), hi - lo) * EC_BYTE_PROGRAM_US;
+			}
+		}
+		if(dirty == 0)
+			continue;
+
+		/* block erase only for the whole block is within the image */
+		if( (unit >= EC_BLOCK_SIZE) || ( (b >= base) && (b + EC_BLOCK_SIZE <= end)
+			&& (EC_BLOCK_ERASE_MS * 1000 + extra_us < dirty * EC_SECTOR_ERASE_MS * 1000) ) ){
+			ec_plan_add(plan, SPICMD_BLK_ERASE, b, EC_BLOCK_SIZE, EC_BLOCK_ERASE_MS);
+			for(a = max(b, base); (a < b + EC_BLOCK_SIZE) && (a < end); a += unit)
+				cls[(a - base) / unit] = EC_UNIT_DIRTY;
+			continue;
+		}
+		for(a = max(b, base); (a < b + EC_BLOCK_SIZE) && (a < end); a += unit){
+			if(cls[(a - base) / unit] == EC_UNIT_DIRTY)
+				ec_plan_add(plan, ec_rom_part->erase_cmd, a, unit, EC_SECTOR_ERASE_MS);
+		}
+	}
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ecjob.plan = *plan;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	printk(KERN_INFO "program ec : %d erase steps planned, %d ms estimated.\n",
+			plan->steps, plan->est_ms);
+}
+
+/* run the erase steps planned and record the time of each one */
+static int ec_erase_run(struct ec_erase_plan *plan)
+{
+	struct ec_erase_step *step;
+	unsigned long flags, start;
+	u32 ms;
+	int i, ret;
+
+	for(i = 0; i < plan->steps; i++){
+		step = &plan->step[i];
+		ret = ec_program_yield();
+		if(ret < 0)
+			return ret;
+		start = jiffies;
+		ret = ec_unit_erase(step->cmd, step->addr);
+		ms = jiffies_to_msecs(jiffies - start);
+
+		spin_lock_irqsave(&ecjob.lock, flags);
+		ecjob.plan.step[i].actual_ms = ms;
+		ecjob.plan.actual_ms += ms;
+		if(ret == 0)
+			ecjob.plan.done = i + 1;
+		spin_unlock_irqrestore(&ecjob.lock, flags);
+
+		if(ret){
+			printk(KERN_ERR "program ec : erase 0x%x at 0x%x failed.\n", step->cmd, step->addr);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * ec_program_begin :
+ *	enter the programming mode and erase the units planned for the image.
+ *	cls[] gets the class of the units covering the image.
+ */
+static int ec_program_begin(int flag, unsigned int addr, unsigned int size, const u8 *buf, u8 *cls)
+{
+	struct ec_erase_plan plan;
+	int ret;
+
+	/* the units only programmed are not unprotected by the erase */
+	ret = ec_program_enter_unprotect(flag);
+	if(ret < 0)
+		return ret;
 
-	size = info->size;
-	ptr  = info->buf;
     PRINTK_DBG(KERN_INFO "starting update ec ROM..............\n");
 
-	ret = ec_unit_erase(SPICMD_BLK_ERASE, addr);
+	ec_job_phase(EC_JOB_PHASE_ERASE);
+	ec_erase_plan(&plan, addr, size, buf, cls);
+	ret = ec_erase_run(&plan);
 	if(ret){
-		printk(KERN_ERR "program ec : erase block failed.\n");
-		goto out;
+		printk(KERN_ERR "program ec : erase failed.\n");
+		ec_program_finish(flag, ret);
+		return ret;
 	}
-	PRINTK_DBG(KERN_ERR "program ec : erase block OK.\n");
+	PRINTK_DBG(KERN_ERR "program ec : erase OK.\n");
+
+	ec_job_phase(EC_JOB_PHASE_PROGRAM);
+
+	return 0;
+}
+
+/*
+ * ec_program_chunk :
+ *	program and verify len bytes to the erased rom from addr.
+ *	0xff bytes are skipped for they are the erased value already,
+ *	*done is increased with the bytes finished and published as the
+ *	job progress, done is NULL when no job is running.
+ */
+static int ec_program_chunk(unsigned int addr, const unsigned char *ptr, unsigned int len, u32 *done)
+{
+	unsigned char data;
+	unsigned char val = 0;
+	int i;
 
-	i = 0;
-	while(i < size){
+	for(i = 0; i < len; i++, addr++){
+		/* ec is only given a break between the sectors */
+		if( ((addr % EC_SECTOR_SIZE) == 0) && (ec_program_yield() < 0) )
+			goto fail;
 		data = *(ptr + i);
+		if(data == 0xff)
+			continue;
 		ec_write_byte(addr, data);
 		ec_read_byte(addr, &val);
 		if(val != data){
@@ -648,12 +1541,38 @@ static int ec_program_rom(struct ec_info *info, int flag)
 				printk("EC : Second flash program failed at:\t");
 				printk("addr : 0x%x, source : 0x%x, dest: 0x%x\n", addr, data, val);
 				printk("This should not happened... STOP\n");
-				break;				
+				goto fail;
 			}
 		}
-		i++;
-		addr++;
+		if( done && ((i + 1) % EC_JOB_REPORT_UNIT) == 0 )
+			ec_job_progress(*done + i + 1);
+	}
+	if(done){
+		*done += len;
+		ec_job_progress(*done);
+	}
+
+	return 0;
+
+fail :
+	if(done){
+		*done += i;
+		ec_job_progress(*done);
 	}
+	return -EIO;
+}
+
+/*
+ * ec_program_end :
+ *	protect the rom again and make ec exit from the programming mode.
+ */
+static void ec_program_end(int flag)
+{
+#ifdef	EC_ROM_PROTECTION
+	unsigned char status;
+#endif
+
+	ec_slice_flag = PROGRAM_FLAG_NONE;
 
 #ifdef	EC_ROM_PROTECTION
 	/* we should start spi access firstly */
@@ -685,6 +1604,8 @@ static int ec_program_rom(struct ec_info *info, int flag)
 			printk(KERN_ERR "EC_PROGRAM_ROM : SPICMD_WRITE_STATUS failed.\n");
 			goto out1;
 	}
+#else
+	ec_start_spi();
 #endif
 
 	/* disable the write action to spi rom */
@@ -693,38 +1614,1478 @@ static int ec_program_rom(struct ec_info *info, int flag)
 			printk(KERN_ERR "EC_PROGRAM_ROM : SPICMD_WRITE_DISABLE failed.\n");
 			goto out1;
 	}
-	
-out1:
-	/* we should stop spi access firstly */
-	ec_stop_spi();
-out:
-	/* for security */
-	for(j = 0; j < 2000; j++)
-		udelay(1000);
+	
+out1:
+	/* wait until the rom finishes its last operation */
+	if(ec_rom_wait_status(SPISTS_WIP, EC_SETTLE_TIMEOUT, NULL) < 0)
+		printk(KERN_ERR "EC_PROGRAM_ROM : rom not ready after programming.\n");
+	ec_stop_spi();
+
+	/* modify for program serial No, after program No exit idle mode and enable WDD */
+	if (flag == PROGRAM_FLAG_ROM) {
+		/* exit from the reset mode */
+		ec_exit_reset_mode();
+	} else {
+		/* ec exit from idle mode */
+		ec_exit_idle_mode();
+		ec_enable_WDD();
+	}
+
+	return;
+}
+
+/* get the rom address which the programming starts from */
+static inline unsigned int ec_program_addr(int flag, u32 start_addr)
+{
+	return start_addr + ((flag == PROGRAM_FLAG_IE) ? IE_START_ADDR : EC_START_ADDR);
+}
+
+/* update the rom content with H/W mode, the clean units are skipped */
+static int ec_program_rom(struct ec_info *info, int flag)
+{
+	unsigned int addr = ec_program_addr(flag, info->start_addr);
+	unsigned int unit = ec_rom_part->erase_size;
+	unsigned int a, lo, hi, end = addr + info->size;
+	u8 cls[EC_PLAN_UNITS_MAX];
+	u32 done = 0;
+	int n, ret;
+
+	ret = ec_program_begin(flag, addr, info->size, info->buf, cls);
+	if(ret < 0)
+		return ret;
+
+	for(a = addr - (addr % unit), n = 0; a < end; a += unit, n++){
+		lo = max(a, addr);
+		hi = min(a + unit, end);
+		if(cls[n] == EC_UNIT_CLEAN){
+			done += hi - lo;
+			ec_job_progress(done);
+			continue;
+		}
+		ret = ec_program_chunk(lo, info->buf + (lo - addr), hi - lo, &done);
+		if(ret < 0)
+			break;
+	}
+	ec_program_finish(flag, ret);
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/* the flag of the mode which ec stays in for the flash driver, PROGRAM_FLAG_XXX */
+static int ec_rom_session = PROGRAM_FLAG_NONE;
+
+/*
+ * ec_rom_probe :
+ *	read the jedec id out of rom with ec in idle mode,
+ *	and pick the part by the manufacturer id.
+ */
+static int ec_rom_probe(void)
+{
+	unsigned char cfg;
+	int i, ret;
+
+	ret = ec_init_idle_mode();
+	if(ret < 0)
+		return ret;
+
+	/* hold the chip select low while the id bytes are shifted out */
+	ec_start_spi();
+	cfg = ec_read(REG_XBISPICFG);
+	ec_write(REG_XBISPICFG, cfg | SPICFG_LOW_SPICS);
+
+	ec_write(REG_XBISPICMD, SPICMD_READ_ID);
+	ret = ec_instruction_cycle();
+	for(i = 0; (ret == 0) && (i < EC_ROM_ID_SIZE); i++){
+		ec_write(REG_XBISPICMD, 0x00);
+		ret = ec_instruction_cycle();
+		ec_rom_id[i] = ec_read(REG_XBISPIDAT);
+	}
+
+	ec_write(REG_XBISPICFG, cfg);
+	ec_stop_spi();
+	ec_exit_idle_mode();
+
+	if(ret < 0){
+		printk(KERN_ERR "EC ROM : read id failed.\n");
+		return ret;
+	}
+
+	for(i = 0; i < ARRAY_SIZE(ec_rom_parts); i++){
+		if(ec_rom_parts[i].id == ec_rom_id[0]){
+			ec_rom_part = &ec_rom_parts[i];
+			break;
+		}
+	}
+	printk(KERN_INFO "EC ROM ID : 0x%x, 0x%x, 0x%x, manufacturer %s, erase unit %dKB.\n",
+			ec_rom_id[0], ec_rom_id[1], ec_rom_id[2], ec_rom_part->name,
+			ec_rom_part->erase_size / 1024);
+
+	return 0;
+}
+
+/*
+ * ec_read_mode_check :
+ *	the dual output read is only taken for the parts known to support
+ *	it, and the mode is only kept if it reads the same as the normal
+ *	read, or the normal read is used.
+ */
+static void ec_read_mode_check(void)
+{
+	unsigned char ref[EC_READ_CHECK_SIZE], val[EC_READ_CHECK_SIZE];
+	int mode = rom_read_mode;
+	int ret;
+
+	if( (mode == EC_READ_MODE_DUAL) && !ec_rom_part->dual ){
+		printk(KERN_INFO "EC ROM : no dual output read on %s, fast read is used.\n",
+				ec_rom_part->name);
+		mode = EC_READ_MODE_FAST;
+	}
+	if( (mode != EC_READ_MODE_FAST) && (mode != EC_READ_MODE_DUAL) ){
+		rom_read_mode = EC_READ_MODE_NORMAL;
+		return;
+	}
+
+	rom_read_mode = EC_READ_MODE_NORMAL;
+	ret = ec_read_seq(EC_START_ADDR, ref, EC_READ_CHECK_SIZE);
+	if(ret == 0){
+		rom_read_mode = mode;
+		ret = ec_read_seq(EC_START_ADDR, val, EC_READ_CHECK_SIZE);
+	}
+	if( (ret < 0) || memcmp(ref, val, EC_READ_CHECK_SIZE) ){
+		printk(KERN_WARNING "EC ROM : read mode %d differs from the normal read, normal read is used.\n",
+				mode);
+		rom_read_mode = EC_READ_MODE_NORMAL;
+	}
+}
+
+/* the smallest erase unit of rom */
+unsigned int ec_rom_erase_size(void)
+{
+	return ec_rom_part->erase_size;
+}
+EXPORT_SYMBOL_GPL(ec_rom_erase_size);
+
+/*
+ * ec_rom_session_begin :
+ *	the flash driver keeps ec in the programming mode from its first
+ *	erase or write until ec_rom_sync(), for entering and exiting the mode
+ *	for each erase unit is too expensive. should be called with ec_flash_lock.
+ */
+static int ec_rom_session_begin(unsigned int addr)
+{
+	int flag = (addr < IE_START_ADDR) ? PROGRAM_FLAG_ROM : PROGRAM_FLAG_IE;
+	int ret;
+
+	if(ec_rom_session == flag)
+		return 0;
+	/* code and IE need different mode, sync should be done between them */
+	if(ec_rom_session != PROGRAM_FLAG_NONE)
+		return -EBUSY;
+
+	if(flag == PROGRAM_FLAG_ROM)
+		ec_ident_invalidate();
+	ret = ec_program_enter_unprotect(flag);
+	if(ret < 0)
+		return ret;
+
+	ec_rom_session = flag;
+	return 0;
+}
+
+/*
+ * ec_rom_erase :
+ *	erase the rom from addr with the smallest erase unit of the part,
+ *	addr and len should be aligned to ec_rom_erase_size().
+ */
+int ec_rom_erase(unsigned int addr, unsigned int len)
+{
+	unsigned int size = ec_rom_part->erase_size;
+	int ret;
+
+	if( (addr % size) || (len % size) || (addr + len > EC_FLASH_SIZE) )
+		return -EINVAL;
+
+	mutex_lock(&ec_flash_lock);
+	if(addr + len > IE_START_ADDR)
+		ec_ie_cache_valid = 0;
+	ret = ec_rom_session_begin(addr);
+	for(; (ret == 0) && len; addr += size, len -= size){
+		ret = ec_unit_erase(ec_rom_part->erase_cmd, addr);
+		if(ret)
+			printk(KERN_ERR "EC ROM : erase failed at 0x%x.\n", addr);
+	}
+	mutex_unlock(&ec_flash_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ec_rom_erase);
+
+/* program and verify the erased rom from addr */
+int ec_rom_write(unsigned int addr, const unsigned char *buf, unsigned int len)
+{
+	int ret;
+
+	if(addr + len > EC_FLASH_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&ec_flash_lock);
+	if(addr + len > IE_START_ADDR)
+		ec_ie_cache_valid = 0;
+	ret = ec_rom_session_begin(addr);
+	if(ret == 0)
+		ret = ec_program_chunk(addr, buf, len, NULL);
+	mutex_unlock(&ec_flash_lock);
+
+	return ret;
+}
+EXPORT_SYMBOL_GPL(ec_rom_write);
+
+/* protect rom again and make ec back to the normal mode */
+void ec_rom_sync(void)
+{
+	mutex_lock(&ec_flash_lock);
+	if(ec_rom_session != PROGRAM_FLAG_NONE){
+		ec_program_end(ec_rom_session);
+		if(ec_rom_session == PROGRAM_FLAG_ROM)
+			ec_ident_refresh(EC_IDENT_DELAY);
+		ec_rom_session = PROGRAM_FLAG_NONE;
+	}
+	mutex_unlock(&ec_flash_lock);
+}
+EXPORT_SYMBOL_GPL(ec_rom_sync);
+
+/* the bytes of the image in the sector */
+static inline unsigned int ec_journal_len(struct ec_journal *jn, unsigned int i)
+{
+	return min_t(unsigned int, jn->sector_size, jn->size - i * jn->sector_size);
+}
+
+/* build the journal for the image, the crc of each sector is recorded */
+static void ec_journal_init(struct ec_journal *jn, struct ec_job_req *req, u8 *buf)
+{
+	unsigned int i;
+
+	memset(jn, 0, sizeof(struct ec_journal));
+	jn->magic = EC_JOURNAL_MAGIC;
+	jn->flag = req->flag & PROGRAM_FLAG_REGION;
+	jn->start_addr = req->start_addr;
+	jn->size = req->size;
+	jn->image_crc = ec_crc32(0, buf, req->size);
+	jn->sector_size = ec_rom_erase_size();
+	jn->sectors = DIV_ROUND_UP(req->size, jn->sector_size);
+	for(i = 0; i < jn->sectors; i++)
+		jn->crc[i] = ec_crc32(0, buf + i * jn->sector_size, ec_journal_len(jn, i));
+}
+
+/* is the saved journal for the same image and rom part */
+static int ec_journal_match(struct ec_journal *saved, struct ec_journal *jn)
+{
+	return (saved->magic == EC_JOURNAL_MAGIC) && (saved->flag == jn->flag)
+		&& (saved->start_addr == jn->start_addr) && (saved->size == jn->size)
+		&& (saved->image_crc == jn->image_crc)
+		&& (saved->sector_size == jn->sector_size)
+		&& (saved->sectors == jn->sectors) && (saved->done <= jn->sectors);
+}
+
+/*
+ * ec_program_journal :
+ *	check the sectors recorded by the journal and resume from the first
+ *	one which is not verified, then erase, program and verify the rest
+ *	sector by sector, the journal is updated after each sector.
+ */
+static int ec_program_journal(struct ec_job *job)
+{
+	struct ec_journal *jn = &job->journal;
+	unsigned int addr = ec_program_addr(job->flag, job->info.start_addr);
+	unsigned int i, len, offset;
+	unsigned long flags;
+	u32 done, crc;
+	int ret;
+
+	ret = ec_program_enter(job->flag);
+	if(ret < 0)
+		return ret;
+
+	for(i = 0; i < jn->done; i++){
+		crc = 0;
+		ret = ec_rom_crc(addr + i * jn->sector_size, ec_journal_len(jn, i), &crc);
+		if( (ret < 0) || (crc != jn->crc[i]) )
+			break;
+	}
+	if(jn->done)
+		printk(KERN_INFO "program journal : resume from sector %d of %d.\n", i, jn->sectors);
+	spin_lock_irqsave(&job->lock, flags);
+	jn->done = i;
+	spin_unlock_irqrestore(&job->lock, flags);
+	done = i * jn->sector_size;
+	ec_job_progress(done);
+
+	for(ret = 0; i < jn->sectors; i++){
+		offset = i * jn->sector_size;
+		len = ec_journal_len(jn, i);
+
+		ec_job_phase(EC_JOB_PHASE_ERASE);
+		ret = ec_unit_erase(ec_rom_part->erase_cmd, addr + offset);
+		if(ret){
+			printk(KERN_ERR "program journal : erase sector %d failed.\n", i);
+			break;
+		}
+
+		ec_job_phase(EC_JOB_PHASE_PROGRAM);
+		ret = ec_program_chunk(addr + offset, job->info.buf + offset, len, &done);
+		if(ret)
+			break;
+		crc = 0;
+		ret = ec_rom_crc(addr + offset, len, &crc);
+		if( (ret == 0) && (crc != jn->crc[i]) ){
+			printk(KERN_ERR "program journal : sector %d crc mismatch.\n", i);
+			ret = -EIO;
+		}
+		if(ret)
+			break;
+
+		spin_lock_irqsave(&job->lock, flags);
+		jn->done = i + 1;
+		spin_unlock_irqrestore(&job->lock, flags);
+	}
+
+	/* ec stays in reset mode for the next job to resume a failed one */
+	ec_program_finish(job->flag, ret);
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/*
+ * ec_piece_wait :
+ *	wait for the ec firmware to finish burning the piece.
+ */
+static int ec_piece_wait(unsigned int timeout_ms)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(timeout_ms);
+	unsigned char status;
+
+	for(;;){
+		status = ec_read(PIECE_STATUS_REG);
+		if(status & PIECE_STATUS_PROGRAM_ERROR)
+			return -EIO;
+		if(status & PIECE_STATUS_PROGRAM_DONE)
+			return 0;
+		if(time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		msleep(EC_STATUS_POLL_INTERVAL);
+	}
+}
+
+/*
+ * ec_program_piece :
+ *	let the ec firmware burn the data to rom piece by piece, ec keeps
+ *	running in normal mode. each piece is stored to ec ram with one block
+ *	write and triggered by CMD_PROGRAM_PIECE, then the firmware erases
+ *	the area for the first piece and burns the data by itself.
+ *	should be called with ec_flash_lock.
+ */
+static int ec_program_piece(unsigned int addr, const unsigned char *buf, unsigned int len)
+{
+	unsigned char piece[PIECE_SIZE + 4];
+	unsigned char val[PIECE_SIZE];
+	unsigned int count, offset;
+	int ret = 0;
+
+	if( (len == 0) || (len > PIECE_MAX_SIZE) )
+		return -EINVAL;
+
+	for(offset = 0; offset < len; offset += count){
+		count = min_t(unsigned int, len - offset, PIECE_SIZE);
+
+		/* the rest of the last piece is padded with the erased value */
+		memset(piece, 0xff, sizeof(piece));
+		piece[0] = (offset == 0) ? FIRST_PIECE_YES : FIRST_PIECE_NO;
+		piece[1] = ((addr + offset) & 0xff0000) >> 16;
+		piece[2] = ((addr + offset) & 0x00ff00) >> 8;
+		piece[3] = ((addr + offset) & 0x0000ff) >> 0;
+		memcpy(piece + 4, buf + offset, count);
+
+		/* the firmware erases the block of the first piece by itself */
+		if(offset == 0)
+			ec_shadow_invalidate(addr & ~(EC_BLOCK_SIZE - 1), EC_BLOCK_SIZE);
+		ec_shadow_invalidate(addr + offset, count);
+		ec_write(PIECE_STATUS_REG, 0x00);
+		ec_write_block(PIECE_START_ADDR, piece, sizeof(piece));
+		ret = ec_query_seq_sleep(CMD_PROGRAM_PIECE);
+		if(ret < 0)
+			break;
+		/* the first piece includes the erasing */
+		ret = ec_piece_wait( (offset == 0) ? EC_PIECE_ERASE_TIMEOUT : EC_PIECE_TIMEOUT );
+		if(ret < 0){
+			printk(KERN_ERR "program piece : %s at 0x%x.\n",
+					(ret == -EIO) ? "ec reports error" : "timeout", addr + offset);
+			break;
+		}
+
+		/* verify */
+		ret = ec_read_seq(addr + offset, val, count);
+		if( (ret == 0) && memcmp(val, buf + offset, count) ){
+			printk(KERN_ERR "program piece : verify failed at 0x%x.\n", addr + offset);
+			ret = -EIO;
+		}
+		if(ret < 0)
+			break;
+	}
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/* the code crc is out of date when the code region is going to be programmed */
+static void ec_ident_invalidate(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec_ident_lock, flags);
+	ec_ident.valid = 0;
+	spin_unlock_irqrestore(&ec_ident_lock, flags);
+}
+
+/* compute the identity again, ec needs a while to run the new firmware */
+static void ec_ident_refresh(unsigned int delay_ms)
+{
+	queue_delayed_work(ec_flash_wq, &ec_ident_work, msecs_to_jiffies(delay_ms));
+}
+
+/*
+ * ec_ident_update :
+ *	read the version from ec and crc32 the code region of rom, the rom
+ *	is read slice by slice so the lock is not held for long.
+ */
+static void ec_ident_update(struct work_struct *work)
+{
+	struct ec_identity ident;
+	unsigned long flags;
+	unsigned int addr;
+	u32 crc = 0;
+	int i, ret = 0;
+
+	memset(&ident, 0, sizeof(struct ec_identity));
+	for(i = 0; i < VER_MAX_SIZE; i++)
+		ident.version[i] = ec_read(VER_ADDR + i);
+	memcpy(ident.rom_id, ec_rom_id, EC_ROM_ID_SIZE);
+
+	for(addr = EC_START_ADDR; addr < EC_START_ADDR + EC_CONTENT_MAX_SIZE; addr += EC_IDENT_SLICE){
+		mutex_lock(&ec_flash_lock);
+		/* the flash driver refreshes it again when it is synced */
+		if( (ec_rom_session != PROGRAM_FLAG_NONE) || (ec_program_held != PROGRAM_FLAG_NONE) )
+			ret = -EBUSY;
+		else
+			ret = ec_rom_crc(addr, EC_IDENT_SLICE, &crc);
+		mutex_unlock(&ec_flash_lock);
+		if(ret < 0)
+			break;
+	}
+	if(ret == 0){
+		ident.code_crc = crc;
+		ident.valid = 1;
+	}
+
+	spin_lock_irqsave(&ec_ident_lock, flags);
+	ec_ident = ident;
+	spin_unlock_irqrestore(&ec_ident_lock, flags);
+
+	PRINTK_DBG(KERN_INFO "EC identity : version %s, code crc 0x%08x.\n", ident.version, crc);
+}
+
+static void ec_ident_get(struct ec_identity *ident)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec_ident_lock, flags);
+	*ident = ec_ident;
+	spin_unlock_irqrestore(&ec_ident_lock, flags);
+}
+
+/******************************************************************************/
+
+/* is the job still queued or running */
+static inline int ec_job_busy(u32 phase)
+{
+	return (phase != EC_JOB_PHASE_NONE) && (phase != EC_JOB_PHASE_DONE)
+		&& (phase != EC_JOB_PHASE_FAILED);
+}
+
+/* is the job with id finished, a newer job means the older one is over */
+static int ec_job_finished(u32 id)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ret = (ecjob.status.id != id) || !ec_job_busy(ecjob.status.phase);
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return ret;
+}
+
+static void ec_job_phase(u32 phase)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ecjob.status.phase = phase;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+}
+
+static void ec_job_progress(u32 done)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ecjob.status.done = done;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+}
+
+/* take a snapshot of the job status with elapsed time and throughput */
+static void ec_job_get_status(struct ec_job_status *status)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if(ec_job_busy(ecjob.status.phase))
+		ecjob.status.elapsed = jiffies_to_msecs(jiffies - ecjob.start);
+	if(ecjob.status.elapsed)
+		ecjob.status.throughput = (u32)(((u64)ecjob.status.done * 1000) / ecjob.status.elapsed);
+	*status = ecjob.status;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+}
+
+/*
+ * ec_job_result :
+ *	the status of the job with id, which is either the current job or
+ *	one of the last finished. -ESRCH if the job is too old.
+ */
+static int ec_job_result(u32 id, struct ec_job_status *status)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	ec_job_get_status(status);
+	if(status->id == id)
+		return 0;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if( id && (ec_job_history[id % EC_JOB_HISTORY].id == id) )
+		*status = ec_job_history[id % EC_JOB_HISTORY];
+	else
+		ret = -ESRCH;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return ret;
+}
+
+/* the error of the finished job with id */
+static int ec_job_error(u32 id)
+{
+	struct ec_job_status status;
+	int ret;
+
+	ret = ec_job_result(id, &status);
+	return ret ? ret : status.error;
+}
+
+/* copy the erase plan of the job to user space */
+static int ec_job_get_plan(void __user *ptr)
+{
+	struct ec_erase_plan *plan;
+	unsigned long flags;
+	int ret = 0;
+
+	plan = kmalloc(sizeof(struct ec_erase_plan), GFP_KERNEL);
+	if(plan == NULL)
+		return -ENOMEM;
+	spin_lock_irqsave(&ecjob.lock, flags);
+	*plan = ecjob.plan;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	if(copy_to_user(ptr, plan, sizeof(struct ec_erase_plan))){
+		printk(KERN_ERR "program plan : copy to user error.\n");
+		ret = -EFAULT;
+	}
+	kfree(plan);
+
+	return ret;
+}
+
+/* the chunk is filled, or no more data comes from the writer */
+static int ec_stream_ready(struct ec_job *job, struct ec_chunk *chunk, int *full)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&job->lock, flags);
+	*full = chunk->full;
+	ret = chunk->full || job->abort;
+	spin_unlock_irqrestore(&job->lock, flags);
+
+	return ret;
+}
+
+/*
+ * ec_stream_next :
+ *	wait for the next chunk from the writer, NULL if the writer is gone
+ *	or gives nothing in EC_STREAM_TIMEOUT. the chunk is not consumed
+ *	until ec_stream_release().
+ */
+static struct ec_chunk *ec_stream_next(struct ec_job *job)
+{
+	struct ec_chunk *chunk = &job->chunk[job->drain];
+	int full = 0;
+
+	if(!wait_event_timeout(job->wq, ec_stream_ready(job, chunk, &full),
+				msecs_to_jiffies(EC_STREAM_TIMEOUT))){
+		printk(KERN_ERR "program stream : no data from the writer in %d ms.\n",
+				EC_STREAM_TIMEOUT);
+		return NULL;
+	}
+
+	return full ? chunk : NULL;
+}
+
+/* give the chunk back to the writer */
+static void ec_stream_release(struct ec_job *job, struct ec_chunk *chunk)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&job->lock, flags);
+	chunk->full = 0;
+	spin_unlock_irqrestore(&job->lock, flags);
+	job->drain = (job->drain + 1) % EC_STREAM_CHUNKS;
+	wake_up(&job->wq);
+}
+
+/*
+ * ec_stream_inflate :
+ *	inflate the zlib stream chunk by chunk into a page window, and the
+ *	window is programmed each time it is full, so neither the compressed
+ *	nor the raw image is ever staged as a whole.
+ */
+static int ec_stream_inflate(struct ec_job *job, unsigned int addr, u32 *done)
+{
+	struct ec_chunk *chunk;
+	z_stream zs;
+	u8 *window;
+	u32 count;
+	int zret = Z_OK;
+	int ret = 0;
+
+	memset(&zs, 0, sizeof(z_stream));
+	zs.workspace = vmalloc(zlib_inflate_workspacesize());
+	window = (u8 *)__get_free_page(GFP_KERNEL);
+	if( (zs.workspace == NULL) || (window == NULL) ){
+		printk(KERN_ERR "program stream : no memory for inflating.\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+	if(zlib_inflateInit(&zs) != Z_OK){
+		ret = -EINVAL;
+		goto out;
+	}
+	zs.next_out = window;
+	zs.avail_out = PAGE_SIZE;
+
+	while(zret != Z_STREAM_END){
+		chunk = ec_stream_next(job);
+		if(chunk == NULL){
+			printk(KERN_ERR "program stream : compressed stream ends at 0x%x.\n", *done);
+			ret = -EPIPE;
+			break;
+		}
+
+		zs.next_in = chunk->buf;
+		zs.avail_in = chunk->len;
+		while( zs.avail_in && (zret != Z_STREAM_END) ){
+			zret = zlib_inflate(&zs, Z_SYNC_FLUSH);
+			if( (zret != Z_OK) && (zret != Z_STREAM_END) ){
+				printk(KERN_ERR "program stream : inflate error %d at 0x%x.\n", zret, *done);
+				ret = -EINVAL;
+				break;
+			}
+			if( zs.avail_out && (zret != Z_STREAM_END) )
+				continue;
+
+			/* the window is full or the last one */
+			count = PAGE_SIZE - zs.avail_out;
+			if(count > job->info.size - *done){
+				printk(KERN_ERR "program stream : image larger than 0x%x.\n", job->info.size);
+				ret = -EFBIG;
+				break;
+			}
+			ret = ec_program_chunk(addr + *done, window, count, done);
+			if(ret < 0)
+				break;
+			zs.next_out = window;
+			zs.avail_out = PAGE_SIZE;
+		}
+
+		ec_stream_release(job, chunk);
+		if(ret < 0)
+			break;
+	}
+	if( (ret == 0) && (*done != job->info.size) ){
+		printk(KERN_ERR "program stream : image 0x%x bytes short of 0x%x.\n",
+				*done, job->info.size);
+		ret = -EINVAL;
+	}
+	zlib_inflateEnd(&zs);
+
+out :
+	if(window)
+		free_page((unsigned long)window);
+	vfree(zs.workspace);
+
+	return ret;
+}
+
+/*
+ * ec_job_stream :
+ *	program the image coming from write() chunk by chunk, the writer
+ *	fills one chunk while the other one is being programmed here.
+ *	nothing is erased before the first chunk comes.
+ */
+static int ec_job_stream(struct ec_job *job)
+{
+	unsigned int addr = ec_program_addr(job->flag, job->info.start_addr);
+	u8 cls[EC_PLAN_UNITS_MAX];
+	struct ec_chunk *chunk;
+	u32 done = 0;
+	int ret;
+
+	if(ec_stream_next(job) == NULL){
+		printk(KERN_ERR "program stream : aborted before any data.\n");
+		return -EPIPE;
+	}
+
+	ret = ec_program_begin(job->flag, addr, job->info.size, NULL, cls);
+	if(ret < 0)
+		return ret;
+
+	if(job->zlib){
+		ret = ec_stream_inflate(job, addr, &done);
+		goto end;
+	}
+
+	while(done < job->info.size){
+		chunk = ec_stream_next(job);
+		if(chunk == NULL){
+			printk(KERN_ERR "program stream : aborted at 0x%x.\n", done);
+			ret = -EPIPE;
+			break;
+		}
+
+		ret = ec_program_chunk(addr + done, chunk->buf, chunk->len, &done);
+
+		ec_stream_release(job, chunk);
+		if(ret < 0)
+			break;
+	}
+
+end :
+	ec_program_finish(job->flag, ret);
+
+	return ret;
+}
+
+/* the worker which does the real programming */
+static void ec_job_work(struct work_struct *work)
+{
+	struct ec_job *job = container_of(work, struct ec_job, work);
+	unsigned long flags;
+	int ret;
+
+	mutex_lock(&ec_flash_lock);
+	if(ec_rom_session != PROGRAM_FLAG_NONE){
+		/* the flash driver is in the middle of its work */
+		printk(KERN_ERR "program job : rom is busy with the flash driver.\n");
+		ret = -EBUSY;
+	}else{
+		/* the cached IE records are out of date once IE is touched */
+		if(job->flag == PROGRAM_FLAG_IE)
+			ec_ie_cache_valid = 0;
+		else
+			ec_ident_invalidate();
+
+		if(job->stream)
+			ret = ec_job_stream(job);
+		else if(job->journaled)
+			ret = ec_program_journal(job);
+		else
+			ret = ec_program_rom(&job->info, job->flag);
+	}
+	mutex_unlock(&ec_flash_lock);
+	if(!job->stream){
+		if(job->fw)
+			release_firmware(job->fw);
+		else
+			vfree(job->info.buf);
+		job->fw = NULL;
+		job->info.buf = NULL;
+	}
+
+	spin_lock_irqsave(&job->lock, flags);
+	job->status.elapsed = jiffies_to_msecs(jiffies - job->start);
+	job->status.error = ret;
+	job->status.phase = ret ? EC_JOB_PHASE_FAILED : EC_JOB_PHASE_DONE;
+	if(job->status.elapsed)
+		job->status.throughput = (u32)(((u64)job->status.done * 1000) / job->status.elapsed);
+	ec_job_history[job->status.id % EC_JOB_HISTORY] = job->status;
+	spin_unlock_irqrestore(&job->lock, flags);
+
+	printk(KERN_INFO "EC program job %d : %s, %d bytes in %d ms.\n", job->status.id,
+			ret ? "failed" : "done", job->status.done, job->status.elapsed);
+	if(job->flag == PROGRAM_FLAG_ROM)
+		ec_ident_refresh(EC_IDENT_DELAY);
+	wake_up(&job->wq);
+}
+
+/* check the job request from user space */
+static int ec_job_check(struct ec_job_req *req)
+{
+	u32 flag = req->flag & PROGRAM_FLAG_REGION;
+
+	if( (req->flag & ~(PROGRAM_FLAG_REGION | PROGRAM_FLAG_JOURNAL | PROGRAM_FLAG_ZLIB))
+		|| ((flag != PROGRAM_FLAG_ROM) && (flag != PROGRAM_FLAG_IE)) ){
+		printk(KERN_ERR "program job : not supported flag.\n");
+		return -EINVAL;
+	}
+	if( (req->flag & PROGRAM_FLAG_JOURNAL) && (req->start_addr % ec_rom_erase_size()) ){
+		printk(KERN_ERR "program job : journal needs start address aligned to 0x%x.\n",
+				ec_rom_erase_size());
+		return -EINVAL;
+	}
+	/* only one block is erased for each programming */
+	if( (req->size == 0) || (req->size > EC_CONTENT_MAX_SIZE)
+		|| (req->start_addr > EC_CONTENT_MAX_SIZE - req->size) ){
+		printk(KERN_ERR "program job : size out of limited.\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * ec_job_submit :
+ *	queue the image in buf(vmalloc-ed) for programming, the buf is owned
+ *	by the job then. If buf is NULL, the job is in streaming mode and
+ *	the image should be fed by ec_stream_feed() from the owner file.
+ *	If fw is given, buf is the data of it and the job releases the fw.
+ *	the job id is returned.
+ */
+static int ec_job_submit(struct ec_job_req *req, u8 *buf, struct file *owner,
+		const struct firmware *fw)
+{
+	static u32 ec_job_id;
+	struct ec_journal jn;
+	int journaled = (req->flag & PROGRAM_FLAG_JOURNAL) != 0;
+	unsigned long flags;
+	int ret, i;
+
+	if(journaled){
+		/* the whole image is needed for the crc of sectors */
+		if(buf == NULL)
+			return -EINVAL;
+		ec_journal_init(&jn, req, buf);
+	}
+	/* the compressed image is inflated from the stream only */
+	if( (req->flag & PROGRAM_FLAG_ZLIB) && (buf != NULL) )
+		return -EINVAL;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if(ec_job_busy(ecjob.status.phase)){
+		spin_unlock_irqrestore(&ecjob.lock, flags);
+		return -EBUSY;
+	}
+	ecjob.journaled = journaled;
+	if(journaled){
+		/* resume with the saved journal only for the same image */
+		if(ec_journal_match(&ec_journal_resume, &jn))
+			jn.done = ec_journal_resume.done;
+		ecjob.journal = jn;
+	}
+	ec_journal_resume.magic = 0;
+	ecjob.flag = req->flag & PROGRAM_FLAG_REGION;
+	ecjob.info.start_addr = req->start_addr;
+	ecjob.info.size = req->size;
+	ecjob.info.buf = buf;
+	ecjob.fw = fw;
+	ecjob.start = jiffies;
+
+	ecjob.stream = (buf == NULL);
+	ecjob.owner = owner;
+	ecjob.fill = 0;
+	ecjob.drain = 0;
+	ecjob.received = 0;
+	ecjob.zlib = (req->flag & PROGRAM_FLAG_ZLIB) != 0;
+	ecjob.limit = ecjob.zlib ? EC_ZLIB_MAX_INPUT : req->size;
+	ecjob.abort = 0;
+	for(i = 0; i < EC_STREAM_CHUNKS; i++)
+		ecjob.chunk[i].full = 0;
+
+	/* job id is always positive for returning from ioctl */
+	if(++ec_job_id > 0x7fffffff)
+		ec_job_id = 1;
+	memset(&ecjob.status, 0, sizeof(struct ec_job_status));
+	memset(&ecjob.plan, 0, sizeof(struct ec_erase_plan));
+	ecjob.status.id = ec_job_id;
+	ecjob.status.flag = req->flag;
+	ecjob.status.total = req->size;
+	ecjob.status.phase = EC_JOB_PHASE_QUEUED;
+	ret = ec_job_id;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	queue_work(ec_flash_wq, &ecjob.work);
+
+	return ret;
+}
+
+/* copy the image from user space and submit the job */
+static int ec_job_submit_user(void __user *ptr)
+{
+	struct ec_job_req req;
+	u8 *buf;
+	int ret;
+
+	if(copy_from_user(&req, ptr, sizeof(struct ec_job_req))){
+		printk(KERN_ERR "program job : copy from user error.\n");
+		return -EFAULT;
+	}
+	ret = ec_job_check(&req);
+	if(ret < 0)
+		return ret;
+
+	buf = vmalloc(req.size);
+	if(buf == NULL){
+		printk(KERN_ERR "program job : vmalloc failed.\n");
+		return -ENOMEM;
+	}
+	if(copy_from_user(buf, (u8 __user *)ptr + sizeof(struct ec_job_req), req.size)){
+		printk(KERN_ERR "program job : copy from user error.\n");
+		vfree(buf);
+		return -EFAULT;
+	}
+
+	ret = ec_job_submit(&req, buf, NULL, NULL);
+	if(ret < 0)
+		vfree(buf);
+
+	return ret;
+}
+
+/* the chunk can be filled, or the job with id is over */
+static int ec_stream_room(u32 id, struct ec_chunk *chunk)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ret = !chunk->full || (ecjob.status.id != id) || !ec_job_busy(ecjob.status.phase);
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return ret;
+}
+
+/*
+ * ec_stream_feed :
+ *	copy the image from user space into the free chunk while the worker
+ *	is programming the other one. the bytes accepted are returned.
+ */
+static ssize_t ec_stream_feed(u32 id, const char __user *buf, size_t len)
+{
+	struct ec_chunk *chunk;
+	unsigned long flags;
+	size_t count, written = 0;
+	int ret = 0;
+
+	mutex_lock(&ec_stream_lock);
+	while(written < len){
+		spin_lock_irqsave(&ecjob.lock, flags);
+		count = min_t(size_t, len - written, PAGE_SIZE);
+		count = min_t(size_t, count, ecjob.limit - ecjob.received);
+		chunk = &ecjob.chunk[ecjob.fill];
+		spin_unlock_irqrestore(&ecjob.lock, flags);
+		if(count == 0){
+			ret = -ENOSPC;
+			break;
+		}
+
+		ret = wait_event_interruptible(ecjob.wq, ec_stream_room(id, chunk));
+		if(ret)
+			break;
+		if(ec_job_finished(id)){
+			ret = ec_job_error(id);
+			if(ret == 0)
+				ret = -EIO;
+			break;
+		}
+
+		/* the worker never touches the free chunk */
+		if(copy_from_user(chunk->buf, buf + written, count)){
+			ret = -EFAULT;
+			break;
+		}
+		spin_lock_irqsave(&ecjob.lock, flags);
+		chunk->len = count;
+		chunk->full = 1;
+		ecjob.fill = (ecjob.fill + 1) % EC_STREAM_CHUNKS;
+		ecjob.received += count;
+		spin_unlock_irqrestore(&ecjob.lock, flags);
+		written += count;
+		wake_up(&ecjob.wq);
+	}
+	mutex_unlock(&ec_stream_lock);
+
+	return written ? written : ret;
+}
+
+/*
+ * ec_stream_owned :
+ *	the id of the streaming job set up by the file, or 0 if none.
+ */
+static u32 ec_stream_owned(struct file *filp)
+{
+	unsigned long flags;
+	u32 id = 0;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if( ecjob.stream && (ecjob.owner == filp) )
+		id = ecjob.status.id;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return id;
+}
+
+/*
+ * ec_stream_finish :
+ *	wait for the streaming job, the job is aborted if the image is not
+ *	fed completely. the end of the compressed stream is only known by
+ *	the worker, so it is told that no more data comes.
+ */
+static int ec_stream_finish(u32 id)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if( (ecjob.status.id == id)
+		&& (ecjob.zlib || (ecjob.received < ecjob.info.size)) )
+		ecjob.abort = 1;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+	wake_up(&ecjob.wq);
+
+	wait_event(ecjob.wq, ec_job_finished(id));
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if(ecjob.status.id == id)
+		ecjob.owner = NULL;
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return ec_job_error(id);
+}
+
+/*
+ * stream the image from user space and wait for the result, used by the
+ * old ioctls. len bytes are fed, which is the compressed size with
+ * PROGRAM_FLAG_ZLIB.
+ */
+static int ec_job_run_user(int flag, const char __user *buf, u32 size, u32 len)
+{
+	struct ec_job_req req;
+	ssize_t count;
+	int id, ret;
+
+	req.flag = flag;
+	req.start_addr = 0;
+	req.size = size;
+	ret = ec_job_check(&req);
+	if(ret < 0)
+		return ret;
+
+	id = ec_job_submit(&req, NULL, NULL, NULL);
+	if(id < 0)
+		return id;
+
+	count = ec_stream_feed(id, buf, len);
+	ret = ec_stream_finish(id);
+	if( (ret == 0) && (count < 0) )
+		ret = count;
+
+	return ret;
+}
+
+/* is the rom owned by the programming job or the flash driver */
+static int ec_rom_busy(void)
+{
+	unsigned long flags;
+	int ret;
+
+	spin_lock_irqsave(&ecjob.lock, flags);
+	ret = ec_job_busy(ecjob.status.phase) || (ec_rom_session != PROGRAM_FLAG_NONE)
+		|| (ec_program_held != PROGRAM_FLAG_NONE);
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return ret;
+}
+
+/* program the small IE data from user space with the piece protocol */
+static int ec_program_piece_user(void __user *ptr)
+{
+	struct ec_job_req req;
+	unsigned char *buf;
+	int ret;
+
+	if(copy_from_user(&req, ptr, sizeof(struct ec_job_req))){
+		printk(KERN_ERR "program piece : copy from user error.\n");
+		return -EFAULT;
+	}
+	if( (req.flag != PROGRAM_FLAG_IE) || (req.size == 0) || (req.size > PIECE_MAX_SIZE)
+		|| (req.start_addr > EC_CONTENT_MAX_SIZE - req.size) ){
+		printk(KERN_ERR "program piece : only IE within %d bytes is supported.\n", PIECE_MAX_SIZE);
+		return -EINVAL;
+	}
+	buf = kmalloc(req.size, GFP_KERNEL);
+	if(buf == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buf, (u8 __user *)ptr + sizeof(struct ec_job_req), req.size)){
+		printk(KERN_ERR "program piece : copy from user error.\n");
+		kfree(buf);
+		return -EFAULT;
+	}
+
+	if(mutex_lock_interruptible(&ec_flash_lock)){
+		kfree(buf);
+		return -ERESTARTSYS;
+	}
+	/* ec must be running its firmware */
+	if(ec_rom_busy()){
+		ret = -EBUSY;
+	}else{
+		ec_ie_cache_valid = 0;
+		ret = ec_program_piece(IE_START_ADDR + req.start_addr, buf, req.size);
+	}
+	mutex_unlock(&ec_flash_lock);
+	kfree(buf);
+
+	return ret;
+}
+
+/******************************************************************************/
+
+/* load the IE record store into cache, should be called with ec_flash_lock */
+static int ec_ie_load(void)
+{
+	int ret;
+
+	if(ec_ie_cache_valid)
+		return 0;
+	ret = ec_rom_fetch(IE_START_ADDR, ec_ie_cache, IE_STORE_SIZE);
+	if(ret < 0)
+		return ret;
+	ec_ie_cache_valid = 1;
+
+	return 0;
+}
+
+static inline int ec_ie_formatted(const unsigned char *raw)
+{
+	return (raw[0] == 'E') && (raw[1] == 'I') && (raw[2] == IE_STORE_VERSION);
+}
+
+/* the IE area is erased, so the store can be created there */
+static int ec_ie_blank(const unsigned char *raw)
+{
+	int i;
+
+	for(i = 0; i < IE_STORE_SIZE; i++){
+		if(raw[i] != 0xff)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * ec_ie_find :
+ *	walk the records and stop at the index-th one, or at the one with
+ *	type if type is not IE_RECORD_END. the offset of the record is
+ *	returned, or -ENOENT with *end set to the offset of the end mark.
+ */
+static int ec_ie_find(const unsigned char *raw, int index, int type, int *end)
+{
+	int off = IE_STORE_HEADER;
+	int i;
+
+	*end = off;
+	if(!ec_ie_formatted(raw))
+		return -ENOENT;
+
+	for(i = 0; (off + 2 <= IE_STORE_SIZE) && (raw[off] != IE_RECORD_END); i++){
+		/* the broken record is treated as the end */
+		if(off + 2 + raw[off + 1] > IE_STORE_SIZE)
+			break;
+		if( (type != IE_RECORD_END) ? (raw[off] == type) : (i == index) )
+			return off;
+		off += 2 + raw[off + 1];
+	}
+	*end = off;
+
+	return -ENOENT;
+}
+
+/*
+ * ec_ie_write :
+ *	put the new store to rom. if only 1 bits are cleared, the bytes changed
+ *	are programmed directly, or the store is rewritten with the piece
+ *	programming which erases it first.
+ */
+static int ec_ie_write(const unsigned char *old, const unsigned char *new)
+{
+	unsigned char val;
+	int i, erase = 0, ret;
+
+	for(i = 0; i < IE_STORE_SIZE; i++){
+		if( (old[i] & new[i]) != new[i] )
+			erase = 1;
+	}
+	if(erase)
+		return ec_program_piece(IE_START_ADDR, new, IE_STORE_SIZE);
+
+	ret = ec_program_enter_unprotect(PROGRAM_FLAG_IE);
+	if(ret < 0)
+		return ret;
+	for(i = 0; i < IE_STORE_SIZE; i++){
+		if(old[i] == new[i])
+			continue;
+		ec_write_byte(IE_START_ADDR + i, new[i]);
+		ec_read_byte(IE_START_ADDR + i, &val);
+		if(val != new[i]){
+			printk(KERN_ERR "IE update : program failed at 0x%x.\n", IE_START_ADDR + i);
+			ret = -EIO;
+			break;
+		}
+	}
+	ec_program_end(PROGRAM_FLAG_IE);
+
+	return ret;
+}
+
+/*
+ * ec_ie_update :
+ *	replace the record in place if the length is not changed, or drop
+ *	the old one and append the new record to the end.
+ *	the store is only created on the erased IE area, the factory contents
+ *	in other layout are never overwritten.
+ *	should be called with ec_flash_lock.
+ */
+static int ec_ie_update(struct ec_ie_record *rec)
+{
+	unsigned char *new;
+	int off, end, size, ret;
+
+	if( (rec->type == IE_RECORD_END) || (rec->len > IE_RECORD_DATA_MAX) )
+		return -EINVAL;
+
+	if(!ec_ie_formatted(ec_ie_cache)){
+		if(!ec_ie_blank(ec_ie_cache)){
+			printk(KERN_ERR "IE update : IE area is not in the record store format.\n");
+			return -ENODATA;
+		}
+	}
+
+	new = kmalloc(IE_STORE_SIZE, GFP_KERNEL);
+	if(new == NULL)
+		return -ENOMEM;
+	memcpy(new, ec_ie_cache, IE_STORE_SIZE);
+	if(!ec_ie_formatted(new)){
+		new[0] = 'E';
+		new[1] = 'I';
+		new[2] = IE_STORE_VERSION;
+	}
+
+	off = ec_ie_find(new, 0, rec->type, &end);
+	if( (off >= 0) && (new[off + 1] == rec->len) ){
+		memcpy(new + off + 2, rec->data, rec->len);
+	}else{
+		if(off >= 0){
+			size = 2 + new[off + 1];
+			memmove(new + off, new + off + size, IE_STORE_SIZE - off - size);
+			memset(new + IE_STORE_SIZE - size, 0xff, size);
+			ec_ie_find(new, -1, IE_RECORD_END, &end);
+		}
+		if(end + 2 + rec->len > IE_STORE_SIZE){
+			ret = -ENOSPC;
+			goto out;
+		}
+		new[end] = rec->type;
+		new[end + 1] = rec->len;
+		memcpy(new + end + 2, rec->data, rec->len);
+	}
+
+	ret = ec_ie_write(ec_ie_cache, new);
+	if(ret < 0){
+		ec_ie_cache_valid = 0;
+		goto out;
+	}
+	memcpy(ec_ie_cache, new, IE_STORE_SIZE);
+
+out :
+	kfree(new);
+	return ret;
+}
+
+/* the IE record store ioctl, reading is served from the cache */
+static int ec_ie_ioctl(u_int cmd, void __user *ptr)
+{
+	struct ec_ie_record rec;
+	int off, end, ret;
+
+	if(copy_from_user(&rec, ptr, sizeof(struct ec_ie_record))){
+		printk(KERN_ERR "IE record : copy from user error.\n");
+		return -EFAULT;
+	}
+
+	if(mutex_lock_interruptible(&ec_flash_lock))
+		return -ERESTARTSYS;
+	if(ec_rom_busy()){
+		ret = -EBUSY;
+		goto out;
+	}
+	ret = ec_ie_load();
+	if(ret < 0)
+		goto out;
+
+	if(cmd == IOCTL_IE_UPDATE){
+		ret = ec_ie_update(&rec);
+		goto out;
+	}
+
+	if(cmd == IOCTL_IE_ENUM)
+		off = ec_ie_find(ec_ie_cache, rec.index, IE_RECORD_END, &end);
+	else if(rec.type != IE_RECORD_END)
+		off = ec_ie_find(ec_ie_cache, 0, rec.type, &end);
+	else
+		off = -EINVAL;
+	if(off < 0){
+		ret = off;
+		goto out;
+	}
+	rec.type = ec_ie_cache[off];
+	rec.len = ec_ie_cache[off + 1];
+	memcpy(rec.data, ec_ie_cache + off + 2, rec.len);
+	mutex_unlock(&ec_flash_lock);
+
+	if(copy_to_user(ptr, &rec, sizeof(struct ec_ie_record))){
+		printk(KERN_ERR "IE record : copy to user error.\n");
+		return -EFAULT;
+	}
+	return 0;
+
+out :
+	mutex_unlock(&ec_flash_lock);
+	return ret;
+}
+
+/******************************************************************************/
+
+/*
+ * ec_fw_same_version :
+ *	the version string at VER_ADDR is built into the firmware image at
+ *	the same offset, the image is taken as the running one only if the
+ *	string there matches exactly, the end mark included.
+ */
+static int ec_fw_same_version(const struct firmware *fw)
+{
+	unsigned int off = VER_ADDR - EC_START_ADDR;
+	u8 ver, img;
+	int i;
+
+	if(fw->size < off + VER_MAX_SIZE)
+		return 0;
+
+	for(i = 0; i < VER_MAX_SIZE; i++){
+		ver = ec_read(VER_ADDR + i);
+		img = fw->data[off + i];
+		/* 0x00 and 0xff both end the string */
+		if( (ver == 0x00) || (ver == 0xff) ){
+			/* no version from ec, update anyway */
+			if(i == 0)
+				return 0;
+			return (img == 0x00) || (img == 0xff);
+		}
+		if(ver != img)
+			return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * ec_fw_loaded :
+ *	callback of request_firmware_nowait(), the image is programmed by the
+ *	job from the firmware buffer directly, and the erase planner skips the
+ *	units not changed.
+ */
+static void ec_fw_loaded(const struct firmware *fw, void *context)
+{
+	struct ec_job_req req;
+	int id;
+
+	if(fw == NULL){
+		printk(KERN_INFO "EC firmware : %s not found.\n", EC_FW_NAME);
+		return;
+	}
+	if( (fw->size == 0) || (fw->size > EC_CONTENT_MAX_SIZE) ){
+		printk(KERN_ERR "EC firmware : bad size %d of %s.\n", (int)fw->size, EC_FW_NAME);
+		goto out;
+	}
+	if(ec_fw_same_version(fw)){
+		printk(KERN_INFO "EC firmware : up to date.\n");
+		goto out;
+	}
 
-	/* modify for program serial No, after program No exit idle mode and enable WDD */
-	if (flag == PROGRAM_FLAG_ROM) {
-		/* exit from the reset mode */
-		ec_exit_reset_mode();
-	} else {
-		/* ec exit from idle mode */
-		ret = ec_exit_idle_mode();
-		ec_enable_WDD();
-		if(ret < 0){
-			return ret;
-		}
+	req.flag = PROGRAM_FLAG_ROM;
+	req.start_addr = 0;
+	req.size = fw->size;
+	id = ec_job_submit(&req, (u8 *)fw->data, NULL, fw);
+	if(id < 0){
+		printk(KERN_ERR "EC firmware : submit update failed %d.\n", id);
+		goto out;
 	}
+	printk(KERN_INFO "EC firmware : updating with %s, job %d.\n", EC_FW_NAME, id);
+	return;
 
-	return 0;
+out :
+	release_firmware(fw);
 }
 
 /******************************************************************************/
 
+/* per file state of the misc device */
+struct ec_misc_file {
+	struct ec_reg reg;
+	u32 job_id;		/* job submitted on the file and not reported yet, or 0 */
+};
+
 /* ioctl  */
 static int misc_ioctl(struct inode * inode, struct file *filp, u_int cmd, u_long arg)
 {
 	void __user *ptr = (void __user *)arg;
-	struct ec_reg *ecreg = (struct ec_reg *)(filp->private_data);
+	struct ec_misc_file *mf = (struct ec_misc_file *)(filp->private_data);
+	struct ec_reg *ecreg = &mf->reg;
+	struct ec_job_status status;
+	struct ec_journal journal;
+	struct ec_identity ident;
+	struct ec_zinfo zinfo;
+	unsigned long flags;
+	u32 size;
 	int ret = 0;
 
 	switch (cmd) {
@@ -767,7 +3128,9 @@ static int misc_ioctl(struct inode * inode, struct file *filp, u_int cmd, u_long
 				printk(KERN_ERR "spi read : out of register address range.\n");
 				return -EINVAL;
 			}
-			ec_read_byte(ecreg->addr, &(ecreg->val));
+			ret = ec_rom_read(ecreg->addr, &(ecreg->val), 1);
+			if(ret < 0)
+				return ret;
 			ret = copy_to_user(ptr, ecreg, sizeof(struct ec_reg));
 			if(ret){
 				printk(KERN_ERR "spi read : copy to user error.\n");
@@ -775,54 +3138,98 @@ static int misc_ioctl(struct inode * inode, struct file *filp, u_int cmd, u_long
 			}
 			break;
 		case IOCTL_PROGRAM_IE :
-			ecinfo.start_addr = EC_START_ADDR;
-			ecinfo.size = EC_CONTENT_MAX_SIZE;
-			ecinfo.buf = (u8 *)kmalloc(ecinfo.size, GFP_KERNEL);
-			if(ecinfo.buf == NULL){
-				printk(KERN_ERR "program ie : kmalloc failed.\n");
-				return -ENOMEM;
-			}
-			ret = copy_from_user(ecinfo.buf, (u8 *)ptr, ecinfo.size);
-			if(ret){
-				printk(KERN_ERR "program ie : copy from user error.\n");
-				kfree(ecinfo.buf);
-				ecinfo.buf = NULL;
+			/* the old interface always has 64KB for the serial No,
+			 * the real length goes by IOCTL_PROGRAM_SUBMIT or write(). */
+			return ec_job_run_user(PROGRAM_FLAG_IE, (const char __user *)ptr,
+					EC_CONTENT_MAX_SIZE, EC_CONTENT_MAX_SIZE);
+		case IOCTL_PROGRAM_EC :
+			if(get_user(size, (u32 *)ptr)){
+				printk(KERN_ERR "program ec : get user error.\n");
 				return -EFAULT;
 			}
-
-			/* use ec_program_rom to write serial No */
-			ec_program_rom(&ecinfo, PROGRAM_FLAG_IE);
-			
-			kfree(ecinfo.buf);
-			ecinfo.buf = NULL;
-			break;
-		case IOCTL_PROGRAM_EC :
-			ecinfo.start_addr = EC_START_ADDR;
-			if(get_user( (ecinfo.size), (u32 *)ptr) ){
+			if(size > EC_CONTENT_MAX_SIZE){
+				printk(KERN_ERR "program ec : size out of limited.\n");
+				return -EINVAL;
+			}
+			return ec_job_run_user(PROGRAM_FLAG_ROM, (const char __user *)ptr + 4,
+					size, size);
+		case IOCTL_PROGRAM_EC_Z :
+			if(copy_from_user(&zinfo, ptr, sizeof(struct ec_zinfo))){
 				printk(KERN_ERR "program ec : get user error.\n");
 				return -EFAULT;
 			}
-			if( (ecinfo.size) > EC_CONTENT_MAX_SIZE ){
+			if( (zinfo.size > EC_CONTENT_MAX_SIZE) || (zinfo.zsize > EC_ZLIB_MAX_INPUT) ){
 				printk(KERN_ERR "program ec : size out of limited.\n");
 				return -EINVAL;
 			}
-			ecinfo.buf = (u8 *)kmalloc(ecinfo.size, GFP_KERNEL);
-			if(ecinfo.buf == NULL){
-				printk(KERN_ERR "program ec : kmalloc failed.\n");
-				return -ENOMEM;
+			return ec_job_run_user(PROGRAM_FLAG_ROM | PROGRAM_FLAG_ZLIB,
+					(const char __user *)ptr + sizeof(struct ec_zinfo),
+					zinfo.size, zinfo.zsize);
+		case IOCTL_PROGRAM_SUBMIT :
+			ret = ec_job_submit_user(ptr);
+			if(ret > 0)
+				mf->job_id = ret;
+			return ret;
+		case IOCTL_PROGRAM_STATUS :
+			if(mf->job_id){
+				ret = ec_job_result(mf->job_id, &status);
+				if(ret){
+					mf->job_id = 0;
+					return ret;
+				}
+				/* the result of the job is reported once */
+				if(!ec_job_busy(status.phase))
+					mf->job_id = 0;
+			}else
+				ec_job_get_status(&status);
+			ret = copy_to_user(ptr, &status, sizeof(struct ec_job_status));
+			if(ret){
+				printk(KERN_ERR "program status : copy to user error.\n");
+				return -EFAULT;
+			}
+			break;
+		case IOCTL_PROGRAM_PIECE :
+			return ec_program_piece_user(ptr);
+		case IOCTL_PROGRAM_PLAN :
+			return ec_job_get_plan(ptr);
+		case IOCTL_IDENTITY :
+			ec_ident_get(&ident);
+			ret = copy_to_user(ptr, &ident, sizeof(struct ec_identity));
+			if(ret){
+				printk(KERN_ERR "identity : copy to user error.\n");
+				return -EFAULT;
 			}
-			ret = copy_from_user(ecinfo.buf, ((u8 *)ptr + 4), ecinfo.size);
+			break;
+		case IOCTL_IE_ENUM :
+		case IOCTL_IE_READ :
+		case IOCTL_IE_UPDATE :
+			return ec_ie_ioctl(cmd, ptr);
+		case IOCTL_JOURNAL_GET :
+			spin_lock_irqsave(&ecjob.lock, flags);
+			if(ecjob.journaled)
+				journal = ecjob.journal;
+			else
+				journal.magic = 0;
+			spin_unlock_irqrestore(&ecjob.lock, flags);
+			if(journal.magic != EC_JOURNAL_MAGIC)
+				return -ENOENT;
+			ret = copy_to_user(ptr, &journal, sizeof(struct ec_journal));
 			if(ret){
-				printk(KERN_ERR "program ec : copy from user error.\n");
-				kfree(ecinfo.buf);
-				ecinfo.buf = NULL;
+				printk(KERN_ERR "journal get : copy to user error.\n");
 				return -EFAULT;
 			}
-	
-			ec_program_rom(&ecinfo, PROGRAM_FLAG_ROM);
-
-			kfree(ecinfo.buf);
-			ecinfo.buf = NULL;
+			break;
+		case IOCTL_JOURNAL_SET :
+			ret = copy_from_user(&journal, ptr, sizeof(struct ec_journal));
+			if(ret){
+				printk(KERN_ERR "journal set : copy from user error.\n");
+				return -EFAULT;
+			}
+			if(journal.magic != EC_JOURNAL_MAGIC)
+				return -EINVAL;
+			spin_lock_irqsave(&ecjob.lock, flags);
+			ec_journal_resume = journal;
+			spin_unlock_irqrestore(&ecjob.lock, flags);
 			break;
 
 		default :
@@ -837,23 +3244,40 @@ static long misc_compat_ioctl(struct file *file, unsigned int cmd, unsigned long
 	return misc_ioctl(file->f_dentry->d_inode, file, cmd, arg);
 }
 
+/*
+ * misc_poll : the device is readable when the job submitted on the file
+ *	is over, until its result is read by IOCTL_PROGRAM_STATUS.
+ */
+static unsigned int misc_poll(struct file *filp, poll_table *wait)
+{
+	struct ec_misc_file *mf = (struct ec_misc_file *)(filp->private_data);
+	unsigned int mask = 0;
+	u32 id = mf->job_id;
+
+	poll_wait(filp, &ecjob.wq, wait);
+	if( id && ec_job_finished(id) )
+		mask = POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
 static int misc_open(struct inode * inode, struct file * filp)
 {
-	struct ec_reg *ecreg = NULL;
-	ecreg = kmalloc(sizeof(struct ec_reg), GFP_KERNEL);
-	if (ecreg) {
-		filp->private_data = ecreg;
+	struct ec_misc_file *mf = NULL;
+	mf = kzalloc(sizeof(struct ec_misc_file), GFP_KERNEL);
+	if (mf) {
+		filp->private_data = mf;
 	}
 
-	return ecreg ? 0 : -ENOMEM;
+	return mf ? 0 : -ENOMEM;
 }
 
 static int misc_release(struct inode * inode, struct file * filp)
 {
-	struct ec_reg *ecreg = (struct ec_reg *)(filp->private_data);
+	struct ec_misc_file *mf = (struct ec_misc_file *)(filp->private_data);
 
 	filp->private_data = NULL;
-	kfree(ecreg);
+	kfree(mf);
 
 	return 0;
 }
@@ -866,6 +3290,7 @@ static struct file_operations ecmisc_fops = {
 	.release	= misc_release,
 	.read		= NULL,
 	.write		= NULL,
+	.poll		= misc_poll,
 #ifdef	CONFIG_64BIT
 	.compat_ioctl = misc_compat_ioctl,
 #else
@@ -875,26 +3300,590 @@ static struct file_operations ecmisc_fops = {
 
 /*********************************************************/
 
+/*
+ * flash_read :
+ *	read the rom content page by page, pread() is supported either.
+ *	the O_NONBLOCK reader gets -EBUSY while a programming job runs.
+ *	the rom is held for the whole reading, so ec enters idle mode for
+ *	the window once at most.
+ */
+static ssize_t flash_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+{
+	unsigned char *page;
+	loff_t pos = *ppos;
+	size_t count, done = 0;
+	int ret = 0;
+
+	if( (pos < 0) || (pos >= EC_FLASH_SIZE) )
+		return 0;
+	if(len > EC_FLASH_SIZE - pos)
+		len = EC_FLASH_SIZE - pos;
+
+	page = (unsigned char *)__get_free_page(GFP_KERNEL);
+	if(page == NULL){
+		printk(KERN_ERR "flash read : get page failed.\n");
+		return -ENOMEM;
+	}
+
+	/* the programming job holds the rom for its whole run */
+	if(filp->f_flags & O_NONBLOCK){
+		if(!mutex_trylock(&ec_flash_lock)){
+			ret = -EBUSY;
+			goto out;
+		}
+	}else if(mutex_lock_interruptible(&ec_flash_lock)){
+		ret = -ERESTARTSYS;
+		goto out;
+	}
+
+	ec_lpc_begin(len);
+	while(done < len){
+		count = min_t(size_t, len - done, PAGE_SIZE);
+		ret = ec_rom_read_locked(pos + done, page, count);
+		if(ret < 0)
+			break;
+		if(copy_to_user(buf + done, page, count)){
+			ret = -EFAULT;
+			break;
+		}
+		done += count;
+	}
+	ec_lpc_end();
+	mutex_unlock(&ec_flash_lock);
+
+out :
+	free_page((unsigned long)page);
+
+	*ppos = pos + done;
+	return done ? done : ret;
+}
+
+static loff_t flash_llseek(struct file *filp, loff_t off, int whence)
+{
+	loff_t pos;
+
+	switch(whence){
+		case SEEK_SET :
+			pos = off;
+			break;
+		case SEEK_CUR :
+			pos = filp->f_pos + off;
+			break;
+		case SEEK_END :
+			pos = EC_FLASH_SIZE + off;
+			break;
+		default :
+			return -EINVAL;
+	}
+	if( (pos < 0) || (pos > EC_FLASH_SIZE) )
+		return -EINVAL;
+	filp->f_pos = pos;
+
+	return pos;
+}
+
+/*
+ * flash_write :
+ *	stream the image to the job set up by IOCTL_FLASH_SETUP on this file.
+ */
+static ssize_t flash_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+{
+	u32 id;
+	ssize_t ret;
+
+	id = ec_stream_owned(filp);
+	if(id == 0){
+		printk(KERN_ERR "flash write : no streaming job set up.\n");
+		return -EINVAL;
+	}
+
+	ret = ec_stream_feed(id, buf, len);
+	if(ret > 0)
+		*ppos += ret;
+
+	return ret;
+}
+
+static int flash_ioctl(struct inode * inode, struct file *filp, u_int cmd, u_long arg)
+{
+	void __user *ptr = (void __user *)arg;
+	struct ec_job_req req;
+	int ret;
+
+	switch (cmd) {
+		case IOCTL_FLASH_SETUP :
+			if(copy_from_user(&req, ptr, sizeof(struct ec_job_req))){
+				printk(KERN_ERR "flash setup : copy from user error.\n");
+				return -EFAULT;
+			}
+			ret = ec_job_check(&req);
+			if(ret < 0)
+				return ret;
+			return ec_job_submit(&req, NULL, filp, NULL);
+
+		default :
+			break;
+	}
+
+	return -EINVAL;
+}
+
+static long flash_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	return flash_ioctl(file->f_dentry->d_inode, file, cmd, arg);
+}
+
+/*
+ * flash_poll : writable when a chunk is free, readable when the job is over
+ */
+static unsigned int flash_poll(struct file *filp, poll_table *wait)
+{
+	unsigned int mask = 0;
+	unsigned long flags;
+
+	poll_wait(filp, &ecjob.wq, wait);
+	spin_lock_irqsave(&ecjob.lock, flags);
+	if(!ec_job_busy(ecjob.status.phase)){
+		if(ecjob.status.phase != EC_JOB_PHASE_NONE)
+			mask |= POLLIN | POLLRDNORM;
+	}else if( ecjob.stream && (ecjob.owner == filp)
+		&& !ecjob.chunk[ecjob.fill].full ){
+		mask |= POLLOUT | POLLWRNORM;
+	}
+	spin_unlock_irqrestore(&ecjob.lock, flags);
+
+	return mask;
+}
+
+/*
+ * flash_flush :
+ *	closing the file waits for the streaming job and reports its result.
+ */
+static int flash_flush(struct file *filp, fl_owner_t id)
+{
+	u32 job_id;
+
+	job_id = ec_stream_owned(filp);
+	if(job_id == 0)
+		return 0;
+
+	return ec_stream_finish(job_id);
+}
+
+static struct file_operations ecflash_fops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	.owner		= THIS_MODULE,
+#endif
+	.llseek		= flash_llseek,
+	.read		= flash_read,
+	.write		= flash_write,
+	.poll		= flash_poll,
+	.flush		= flash_flush,
+#ifdef	CONFIG_64BIT
+	.compat_ioctl = flash_compat_ioctl,
+#else
+	.ioctl		= flash_ioctl,
+#endif
+};
+
+/*********************************************************/
+
+/* firmware identity in sysfs of the misc device */
+static ssize_t version_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ec_identity ident;
+
+	ec_ident_get(&ident);
+	return sprintf(buf, "%s\n", ident.version);
+}
+
+static ssize_t rom_id_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ec_identity ident;
+
+	ec_ident_get(&ident);
+	return sprintf(buf, "%02x%02x%02x\n", ident.rom_id[0], ident.rom_id[1], ident.rom_id[2]);
+}
+
+static ssize_t code_crc_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct ec_identity ident;
+
+	ec_ident_get(&ident);
+	if(!ident.valid)
+		return -EAGAIN;
+	return sprintf(buf, "%08x\n", ident.code_crc);
+}
+
+static DEVICE_ATTR(version, 0444, version_show, NULL);
+static DEVICE_ATTR(rom_id, 0444, rom_id_show, NULL);
+static DEVICE_ATTR(code_crc, 0444, code_crc_show, NULL);
+
+static struct device_attribute *ec_ident_attrs[] = {
+	&dev_attr_version,
+	&dev_attr_rom_id,
+	&dev_attr_code_crc,
+};
+
+/*********************************************************/
+
+#ifdef	EC_FLASH_SIM
+/*
+ * flashing benchmark against the simulator, write the operation to
+ * /proc/ec_flash_bench and read the result back :
+ *	full	program the code region with a new image
+ *	diff	program the same image with one sector changed
+ *	clear	program the same image with bits of one sector cleared, which
+ *			needs no erase
+ *	ie		update one record of the IE store
+ *	dump	read out the code and IE region
+ *	break	give ec EC_BENCH_BREAKS breaks of the IE programming, the
+ *			cost of one break is the wall time divided by it
+ * the wall time, port io count and udelay busy waiting time are reported.
+ */
+#define	EC_BENCH_PROC		"ec_flash_bench"
+#define	EC_BENCH_BUF_SIZE	256
+
+static struct proc_dir_entry *ec_bench_entry;
+static DEFINE_MUTEX(ec_bench_lock);
+static char ec_bench_result[EC_BENCH_BUF_SIZE];
+/* seed of the image, changed by each full run */
+static u32 ec_bench_seed;
+
+/* image of the bench */
+#define	EC_BENCH_FULL		0
+#define	EC_BENCH_DIFF		1
+#define	EC_BENCH_CLEAR		2
+
+static u8 *ec_bench_image(int mode)
+{
+	u8 *buf;
+	int i;
+
+	buf = vmalloc(EC_CONTENT_MAX_SIZE);
+	if(buf == NULL)
+		return NULL;
+	for(i = 0; i < EC_CONTENT_MAX_SIZE; i++)
+		buf[i] = (u8)((i * 31 + (i >> 8)) ^ ec_bench_seed);
+	for(i = 3 * EC_SECTOR_SIZE; i < 3 * EC_SECTOR_SIZE + 64; i++){
+		if(mode == EC_BENCH_DIFF)
+			buf[i] ^= 0x5a;
+		else if(mode == EC_BENCH_CLEAR)
+			buf[i] = 0x00;
+	}
+
+	return buf;
+}
+
+static int ec_bench_program(int mode)
+{
+	struct ec_job_req req = { PROGRAM_FLAG_ROM, 0, EC_CONTENT_MAX_SIZE };
+	u8 *buf;
+	int id;
+
+	if(mode == EC_BENCH_FULL)
+		ec_bench_seed++;
+	buf = ec_bench_image(mode);
+	if(buf == NULL)
+		return -ENOMEM;
+	id = ec_job_submit(&req, buf, NULL, NULL);
+	if(id < 0){
+		vfree(buf);
+		return id;
+	}
+	wait_event(ecjob.wq, ec_job_finished(id));
+
+	return ec_job_error(id);
+}
+
+static int ec_bench_ie(void)
+{
+	struct ec_ie_record *rec;
+	int ret;
+
+	rec = kzalloc(sizeof(struct ec_ie_record), GFP_KERNEL);
+	if(rec == NULL)
+		return -ENOMEM;
+	rec->type = 0x01;
+	rec->len = 16;
+	snprintf((char *)rec->data, rec->len, "SN%08lx", jiffies);
+
+	mutex_lock(&ec_flash_lock);
+	ret = ec_ie_load();
+	if(ret == 0)
+		ret = ec_ie_update(rec);
+	mutex_unlock(&ec_flash_lock);
+	kfree(rec);
+
+	return ret;
+}
+
+#define	EC_BENCH_BREAKS		16
+
+static int ec_bench_break(void)
+{
+	int i, ret;
+
+	mutex_lock(&ec_flash_lock);
+	if(ec_rom_busy()){
+		mutex_unlock(&ec_flash_lock);
+		return -EBUSY;
+	}
+	ret = ec_program_enter(PROGRAM_FLAG_IE);
+	if(ret == 0){
+		for(i = 0; (ret == 0) && (i < EC_BENCH_BREAKS); i++)
+			ret = ec_program_break();
+		ec_program_end(PROGRAM_FLAG_IE);
+	}
+	mutex_unlock(&ec_flash_lock);
+
+	return ret;
+}
+
+static int ec_bench_dump(void)
+{
+	unsigned int addr;
+	u8 *buf;
+	int ret = 0;
+
+	buf = vmalloc(EC_FLASH_SIZE);
+	if(buf == NULL)
+		return -ENOMEM;
+	/* measure the rom reading, not the shadow */
+	mutex_lock(&ec_flash_lock);
+	ec_shadow_invalidate(0, EC_FLASH_SIZE);
+	mutex_unlock(&ec_flash_lock);
+	for(addr = 0; (ret == 0) && (addr < EC_FLASH_SIZE); addr += PAGE_SIZE)
+		ret = ec_rom_read(addr, buf + addr, PAGE_SIZE);
+	vfree(buf);
+
+	return ret;
+}
+
+static ssize_t ec_bench_read(struct file *file, char __user *buf, size_t len, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&ec_bench_lock);
+	ret = simple_read_from_buffer(buf, len, ppos, ec_bench_result, strlen(ec_bench_result));
+	mutex_unlock(&ec_bench_lock);
+
+	return ret;
+}
+
+static ssize_t ec_bench_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+	static const char *ops[] = { "full", "diff", "clear", "ie", "dump", "break" };
+	struct ec_sim_stats stats;
+	char op[8];
+	ktime_t start;
+	s64 us;
+	int i, ret;
+
+	if(len >= sizeof(op))
+		return -EINVAL;
+	if(copy_from_user(op, buf, len))
+		return -EFAULT;
+	op[len] = '\0';
+	for(i = 0; i < ARRAY_SIZE(ops); i++){
+		if(strncmp(op, ops[i], strlen(ops[i])) == 0)
+			break;
+	}
+	if(i == ARRAY_SIZE(ops))
+		return -EINVAL;
+
+	mutex_lock(&ec_bench_lock);
+	ec_sim_reset_stats();
+	start = ktime_get();
+	switch(i){
+		case	EC_BENCH_FULL :
+		case	EC_BENCH_DIFF :
+		case	EC_BENCH_CLEAR :
+				ret = ec_bench_program(i);
+				break;
+		case	3 :
+				ret = ec_bench_ie();
+				break;
+		case	4 :
+				ret = ec_bench_dump();
+				break;
+		default :
+				ret = ec_bench_break();
+	}
+	us = ktime_us_delta(ktime_get(), start);
+	ec_sim_get_stats(&stats);
+
+	snprintf(ec_bench_result, EC_BENCH_BUF_SIZE,
+			"%s : result %d, wall %lld us, port io %llu, spi cmds %llu, busy wait %llu us, lpc %llu bytes\n",
+			ops[i], ret, (long long)us, (unsigned long long)stats.port_io,
+			(unsigned long long)stats.spi_cmds, (unsigned long long)stats.busy_us,
+			(unsigned long long)stats.lpc_bytes);
+	printk(KERN_INFO "EC bench %s", ec_bench_result);
+	mutex_unlock(&ec_bench_lock);
+
+	return len;
+}
+
+static struct file_operations ec_bench_fops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	owner :	THIS_MODULE,
+#endif
+	read  : ec_bench_read,
+	write : ec_bench_write,
+};
+#endif
+
+/*********************************************************/
+
 static struct miscdevice ecmisc_device = {
 	.minor		= ECMISC_MINOR_DEV,
 	.name		= EC_MISC_DEV,
 	.fops		= &ecmisc_fops
 };
 
+static struct miscdevice ecflash_device = {
+	.minor		= ECFLASH_MINOR_DEV,
+	.name		= EC_FLASH_DEV,
+	.fops		= &ecflash_fops
+};
+
+/* free the pages for streaming */
+static void ec_stream_free(void)
+{
+	int i;
+
+	for(i = 0; i < EC_STREAM_CHUNKS; i++){
+		if(ecjob.chunk[i].buf)
+			free_page((unsigned long)ecjob.chunk[i].buf);
+		ecjob.chunk[i].buf = NULL;
+	}
+}
+
 static int __init ecmisc_init(void)
 {
-	int ret;
+	int ret, i;
 
 	printk(KERN_INFO "EC misc device init.\n");
+
+#ifdef	EC_FLASH_SIM
+	ret = ec_sim_init();
+	if(ret)
+		return ret;
+#endif
+
+	/* programming job runs in its own worker */
+	ec_flash_wq = create_singlethread_workqueue("ec_flash");
+	if(ec_flash_wq == NULL){
+		printk(KERN_ERR "EC misc : create workqueue failed.\n");
+		ret = -ENOMEM;
+		goto out_sim;
+	}
+	INIT_WORK(&ecjob.work, ec_job_work);
+	INIT_DELAYED_WORK(&ec_ident_work, ec_ident_update);
+	spin_lock_init(&ecjob.lock);
+	init_waitqueue_head(&ecjob.wq);
+
+	/* the erase unit falls back to the block if the part is unknown */
+	ec_rom_probe();
+	ec_read_mode_check();
+
+	/* only single pages are used for streaming the image */
+	for(i = 0; i < EC_STREAM_CHUNKS; i++){
+		ecjob.chunk[i].buf = (unsigned char *)__get_free_page(GFP_KERNEL);
+		if(ecjob.chunk[i].buf == NULL){
+			printk(KERN_ERR "EC misc : get page for streaming failed.\n");
+			ret = -ENOMEM;
+			goto out_page;
+		}
+	}
+
+	if(lpc_window){
+		ec_lpc = ioremap_nocache(lpc_window, EC_LPC_WINDOW_SIZE);
+		if(ec_lpc == NULL)
+			printk(KERN_NOTICE "EC misc : map lpc window 0x%lx failed.\n", lpc_window);
+	}
+
+	/* reading works without the shadow too */
+	ec_shadow = vmalloc(EC_FLASH_SIZE);
+	if(ec_shadow == NULL)
+		printk(KERN_NOTICE "EC misc : no memory for the rom shadow.\n");
+
 	ret = misc_register(&ecmisc_device);
+	if(ret){
+		goto out_page;
+	}
+	ret = misc_register(&ecflash_device);
+	if(ret){
+		printk(KERN_ERR "EC misc : register flash device failed.\n");
+		goto out_misc;
+	}
+	for(i = 0; i < ARRAY_SIZE(ec_ident_attrs); i++){
+		if(device_create_file(ecmisc_device.this_device, ec_ident_attrs[i]))
+			printk(KERN_ERR "EC misc : create identity attribute failed.\n");
+	}
+
+	/* the code crc takes a while, do it in the worker */
+	ec_ident_refresh(0);
+
+	if(fw_update){
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+		ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, EC_FW_NAME,
+				ecmisc_device.this_device, NULL, ec_fw_loaded);
+#else
+		ret = request_firmware_nowait(THIS_MODULE, FW_ACTION_HOTPLUG, EC_FW_NAME,
+				ecmisc_device.this_device, GFP_KERNEL, NULL, ec_fw_loaded);
+#endif
+		if(ret)
+			printk(KERN_ERR "EC misc : request firmware failed %d.\n", ret);
+	}
+
+#ifdef	EC_FLASH_SIM
+	ec_bench_entry = create_proc_entry(EC_BENCH_PROC, S_IWUSR | S_IRUGO, NULL);
+	if(ec_bench_entry)
+		ec_bench_entry->proc_fops = &ec_bench_fops;
+#endif
+
+	return 0;
 
+out_misc :
+	misc_deregister(&ecmisc_device);
+out_page :
+	vfree(ec_shadow);
+	if(ec_lpc)
+		iounmap(ec_lpc);
+	ec_stream_free();
+	destroy_workqueue(ec_flash_wq);
+out_sim :
+#ifdef	EC_FLASH_SIM
+	ec_sim_exit();
+#endif
 	return ret;
 }
 
 static void __exit ecmisc_exit(void)
 {
+	int i;
+
 	printk(KERN_INFO "EC misc device exit.\n");
+#ifdef	EC_FLASH_SIM
+	if(ec_bench_entry)
+		remove_proc_entry(EC_BENCH_PROC, NULL);
+#endif
+	for(i = 0; i < ARRAY_SIZE(ec_ident_attrs); i++)
+		device_remove_file(ecmisc_device.this_device, ec_ident_attrs[i]);
+	misc_deregister(&ecflash_device);
 	misc_deregister(&ecmisc_device);
+	/* wait for the running job, which may refresh the identity again */
+	flush_workqueue(ec_flash_wq);
+	cancel_delayed_work_sync(&ec_ident_work);
+	destroy_workqueue(ec_flash_wq);
+	vfree(ec_shadow);
+	if(ec_lpc)
+		iounmap(ec_lpc);
+	ec_stream_free();
+#ifdef	EC_FLASH_SIM
+	ec_sim_exit();
+#endif
 }
 
 module_init(ecmisc_init);
@@ -27,6 +27,12 @@
 #define	PROGRAM_FLAG_NONE	0x00
 #define	PROGRAM_FLAG_IE		0x01
 #define	PROGRAM_FLAG_ROM	0x02
+/* or-ed with above for the resumable programming with journal */
+#define	PROGRAM_FLAG_JOURNAL	0x10
+/* or-ed with above for the zlib compressed image, only for the streaming */
+#define	PROGRAM_FLAG_ZLIB	0x20
+/* the region to program, PROGRAM_FLAG_ROM or PROGRAM_FLAG_IE */
+#define	PROGRAM_FLAG_REGION	0x0f
 
 /* XBI relative registers */
 #define REG_XBISEG0     0xFEA0
@@ -63,6 +69,7 @@
 #define	SPICMD_SEC_ERASE		0xD7
 #define	SPICMD_BLK_ERASE		0xD8
 #define SPICMD_CHIP_ERASE		0xC7
+#define	SPICMD_READ_ID			0x9F
 
 /* bits definition for REG_XBISPICFG */
 #define	SPICFG_AUTO_CHECK		0x01
@@ -74,6 +81,11 @@
 #define	SPICFG_EN_OFFSET_READ	0x40
 #define	SPICFG_EN_FAST_READ		0x80
 
+/* bits definition for the spi rom status register */
+#define	SPISTS_WIP				0x01	// write in progress
+#define	SPISTS_WEL				0x02	// write enable latch
+#define	SPISTS_BP				0x1C	// block protect bits BP0~BP2
+
 /* SMBUS relative register block according to the EC datasheet. */
 #define	REG_SMBTCRC				0xff92
 #define	REG_SMBPIN				0xff93
@@ -101,6 +113,11 @@
 
 /* lpc configure register */
 #define	REG_LPCCFG				0xfe95
+#define	LPCCFG_EN_FWH			(1 << 7)	// FWH/LPC memory decoding of the rom
+/* the FWH/LPC memory window shows the 64KB segment of rom set in REG_XBISEG0 */
+#define	EC_LPC_WINDOW_SIZE		(64 * 1024)
+/* a reading from this size may put ec in idle mode for the window on a shadow miss */
+#define	EC_LPC_MIN_READ			(4 * 1024)
 
 /* 8051 reg */
 #define	REG_PXCFG				0xff14
@@ -115,22 +132,74 @@
 #define	EC_ROM_PRODUCT_ID_MXIC		0xC2
 #define	EC_ROM_PRODUCT_ID_AMIC		0x37
 #define	EC_ROM_PRODUCT_ID_EONIC		0x1C
+/* jedec id : manufacturer, memory type, capacity */
+#define	EC_ROM_ID_SIZE		3
+/* erase unit of rom, SPICMD_SST_SEC_ERASE and SPICMD_BLK_ERASE */
+#define	EC_SECTOR_SIZE		(4 * 1024)
+#define	EC_BLOCK_SIZE		(64 * 1024)
+/* the rom read is shadowed in memory by lines */
+#define	EC_SHADOW_LINE		256
+#define	EC_SHADOW_LINES		(EC_FLASH_SIZE / EC_SHADOW_LINE)
 
 /**************************************************************/
 
 /* Ec misc device name */
 #define	EC_MISC_DEV		"ec_misc"
 
+/* firmware image loaded by request_firmware for updating at load */
+#define	EC_FW_NAME		"ec/kb3310b.bin"
+
 /* Ec misc device minor number */
 #define	ECMISC_MINOR_DEV	MISC_DYNAMIC_MINOR	
 
+/* Ec flash device for streaming the image through write() and dumping rom through read() */
+#define	EC_FLASH_DEV		"ec_flash"
+#define	ECFLASH_MINOR_DEV	MISC_DYNAMIC_MINOR
+/* rom size seen from the flash device, ec code and IE are both included */
+#define	EC_FLASH_SIZE		(IE_START_ADDR + EC_CONTENT_MAX_SIZE)
+
+/*
+ * rom read mode for the bulk reading, the mode is checked at load against
+ * the normal read of the first EC_READ_CHECK_SIZE bytes, and the normal
+ * read is used if they differ.
+ *	FAST is the high speed read of the original code, SPICFG_EN_FAST_READ
+ *	is left as it is.
+ *	DUAL sets SPICFG_EN_FAST_READ for the dual output read, it is only
+ *	taken for AMIC and EONIC, the other parts read with FAST.
+ */
+#define	EC_READ_MODE_NORMAL	0	// SPICMD_READ_BYTE
+#define	EC_READ_MODE_FAST	1	// SPICMD_HIGH_SPEED_READ
+#define	EC_READ_MODE_DUAL	2	// SPICMD_FRDO, dual output fast read
+#define	EC_READ_CHECK_SIZE	64
+
 #define	EC_IOC_MAGIC		'E'
 /* misc ioctl operations */
 #define	IOCTL_RDREG		_IOR(EC_IOC_MAGIC, 1, int)
 #define	IOCTL_WRREG		_IOW(EC_IOC_MAGIC, 2, int)
 #define	IOCTL_READ_EC		_IOR(EC_IOC_MAGIC, 3, int)
+/* IE programming, the image of EC_CONTENT_MAX_SIZE bytes */
 #define	IOCTL_PROGRAM_IE	_IOW(EC_IOC_MAGIC, 4, int)
+/* ec code programming, u32 size followed by the image of size bytes */
 #define	IOCTL_PROGRAM_EC	_IOW(EC_IOC_MAGIC, 5, int)
+#define	IOCTL_PROGRAM_SUBMIT	_IOW(EC_IOC_MAGIC, 6, int)
+#define	IOCTL_PROGRAM_STATUS	_IOR(EC_IOC_MAGIC, 7, int)
+/* flash device ioctl operations */
+#define	IOCTL_FLASH_SETUP	_IOW(EC_IOC_MAGIC, 8, int)
+/* journal of the resumable programming */
+#define	IOCTL_JOURNAL_GET	_IOR(EC_IOC_MAGIC, 9, int)
+#define	IOCTL_JOURNAL_SET	_IOW(EC_IOC_MAGIC, 10, int)
+/* IE programming by ec firmware, ec_job_req with data as IOCTL_PROGRAM_SUBMIT */
+#define	IOCTL_PROGRAM_PIECE	_IOW(EC_IOC_MAGIC, 11, int)
+/* IE record store operations, struct ec_ie_record */
+#define	IOCTL_IE_ENUM		_IOWR(EC_IOC_MAGIC, 12, int)
+#define	IOCTL_IE_READ		_IOWR(EC_IOC_MAGIC, 13, int)
+#define	IOCTL_IE_UPDATE		_IOW(EC_IOC_MAGIC, 14, int)
+/* firmware identity, struct ec_identity */
+#define	IOCTL_IDENTITY		_IOR(EC_IOC_MAGIC, 15, int)
+/* erase plan of the running job, struct ec_erase_plan */
+#define	IOCTL_PROGRAM_PLAN	_IOR(EC_IOC_MAGIC, 16, int)
+/* ec code programming with the zlib compressed image, struct ec_zinfo */
+#define	IOCTL_PROGRAM_EC_Z	_IOW(EC_IOC_MAGIC, 17, int)
 
 /* start address for programming of EC content or IE */
 #define	EC_START_ADDR	0x00000000	// ec running code start address
@@ -143,9 +212,21 @@
 /* timeout value for programming */
 #define	EC_FLASH_TIMEOUT	0x1000	// ec program timeout
 #define	EC_CMD_TIMEOUT		0x1000	// command checkout timeout including cmd to port or state flag check
+#define	EC_OBF_TIMEOUT		100		// polls for the answer of a query on the data port
 #define	EC_SPICMD_STANDARD_TIMEOUT	(4 * 1000)	// unit : us
 #define	EC_MAX_DELAY_UNIT	(10)			// every time for polling
 #define	SPI_FINISH_WAIT_TIME	10
+/* commands longer than this are polled with sleeping instead of busy-wait */
+#define	EC_SPICMD_SLEEP_TIMEOUT	(100 * 1000)	// unit : us
+/* rom status polling with sleep, unit : ms */
+#define	EC_STATUS_POLL_INTERVAL	1
+/* ec runs its firmware this long between the slices of IE programming, unit : ms */
+#define	EC_SLICE_BREAK_MS		1
+/* tries of taking ec back to idle mode after the break */
+#define	EC_SLICE_RETRY			3
+#define	EC_UNPROTECT_TIMEOUT	500		// first unprotect try, then 5.5s and 10.5s
+#define	EC_UNPROTECT_RETRY_STEP	5000
+#define	EC_SETTLE_TIMEOUT		2000	// rom settle time after programming
 /* EC content max size */
 #define	EC_CONTENT_MAX_SIZE	(64 * 1024)
 #define	IE_CONTENT_MAX_SIZE	(0x100000 - IE_START_ADDR)
@@ -173,6 +254,47 @@
 #define	PIECE_STATUS_PROGRAM_DONE	0x80	// piece program status reg done flag
 #define	PIECE_STATUS_PROGRAM_ERROR	0x40	// piece program status reg error flag
 #define	PIECE_START_ADDR	0xF800			// 32bytes should be stored here
+#define	PIECE_MAX_SIZE		256				// max data for one piece programming
+#define	EC_PIECE_ERASE_TIMEOUT	1000		// first piece with erasing, unit : ms
+#define	EC_PIECE_TIMEOUT		100			// unit : ms
+
+/*
+ * IE record store at IE_START_ADDR :
+ *	-------------------------------------------------------------------
+ *	| 'E' | 'I' | version | type | len | data | type | len | data | 0xff
+ *	-------------------------------------------------------------------
+ *	the records follow the 3 bytes header, the type 0xff(erased value)
+ *	ends the store. the whole store fits in one piece programming.
+ *	the store is only created on the erased IE area, IOCTL_IE_UPDATE fails
+ *	with -ENODATA if the area holds other contents.
+ */
+#define	IE_STORE_SIZE		PIECE_MAX_SIZE
+#define	IE_STORE_HEADER		3
+#define	IE_STORE_VERSION	0x01
+#define	IE_RECORD_END		0xff
+#define	IE_RECORD_DATA_MAX	(IE_STORE_SIZE - IE_STORE_HEADER - 2)
+
+/* record access struct */
+struct ec_ie_record {
+	u32 index;	/* IOCTL_IE_ENUM : the index-th record is returned */
+	u8	type;	/* IOCTL_IE_READ & IOCTL_IE_UPDATE : the record type, not 0xff */
+	u8	len;	/* data length */
+	u8	data[IE_RECORD_DATA_MAX];
+};
+
+/*
+ * firmware identity for IOCTL_IDENTITY, also shown in sysfs of the misc
+ * device as version, rom_id and code_crc. It is computed once at load
+ * and after the code is programmed, so reading it costs no spi access.
+ */
+struct ec_identity {
+	u8	version[VER_MAX_SIZE + 1];	/* firmware version, 0 ended */
+	u8	rom_id[EC_ROM_ID_SIZE];		/* jedec id of rom */
+	u8	valid;						/* code_crc is computed */
+	u32	code_crc;					/* crc32 of the ec code region */
+};
+#define	EC_IDENT_SLICE		(4 * 1024)	// rom read for crc each time with the lock
+#define	EC_IDENT_DELAY		1000		// ms for ec to restart after programming
 
 /* the register operation access struct */
 struct ec_reg {
@@ -186,3 +308,122 @@ struct ec_info {
 	u8	*buf;
 };
 
+/* programming job phase */
+#define	EC_JOB_PHASE_NONE		0x00	// no job submitted yet
+#define	EC_JOB_PHASE_QUEUED		0x01	// waiting for the worker
+#define	EC_JOB_PHASE_ERASE		0x02	// erasing the rom
+#define	EC_JOB_PHASE_PROGRAM	0x03	// programming and verifying
+#define	EC_JOB_PHASE_DONE		0x04	// finished successfully
+#define	EC_JOB_PHASE_FAILED		0x05	// finished with error
+
+/* progress is published every EC_JOB_REPORT_UNIT bytes */
+#define	EC_JOB_REPORT_UNIT		256
+/* page chunks for streaming, one is filled while the other is programmed */
+#define	EC_STREAM_CHUNKS		2
+/* the compressed stream never needs more than this */
+#define	EC_ZLIB_MAX_INPUT		(EC_CONTENT_MAX_SIZE * 2)
+/* the stream fails if the writer gives no chunk in this time, unit : ms */
+#define	EC_STREAM_TIMEOUT		5000
+/* finished job status kept for IOCTL_PROGRAM_STATUS by job id */
+#define	EC_JOB_HISTORY			8
+
+/*
+ * programming job request for IOCTL_PROGRAM_SUBMIT :
+ *	---------------------------------------
+ *	| struct ec_job_req | image data	  |
+ *	---------------------------------------
+ *	the image data of size bytes follows the request header directly,
+ *	the ioctl returns the job id which is reported in ec_job_status.
+ *
+ *	IOCTL_FLASH_SETUP on EC_FLASH_DEV takes the header only, and the image
+ *	is streamed by write() on the same file. close() waits for the job
+ *	and returns its result.
+ */
+struct ec_job_req {
+	u32 flag;		/* PROGRAM_FLAG_ROM or PROGRAM_FLAG_IE */
+	u32 start_addr;	/* offset to EC_START_ADDR or IE_START_ADDR */
+	u32 size;		/* image size */
+};
+
+/*
+ * compressed ec code for IOCTL_PROGRAM_EC_Z :
+ *	-----------------------------------------
+ *	| struct ec_zinfo | zlib compressed data |
+ *	-----------------------------------------
+ *	the data is inflated page by page into the programming, the raw image
+ *	is never staged in kernel. the same zlib(RFC1950) stream can be written
+ *	to EC_FLASH_DEV after IOCTL_FLASH_SETUP with PROGRAM_FLAG_ZLIB, then
+ *	the size of ec_job_req is the inflated size too.
+ */
+struct ec_zinfo {
+	u32 size;		/* inflated image size */
+	u32 zsize;		/* compressed data size */
+};
+
+/*
+ * journal for the programming job with PROGRAM_FLAG_JOURNAL :
+ *	the image is erased, programmed and verified sector by sector, and
+ *	the sectors finished are recorded here. The updater saves the journal
+ *	got by IOCTL_JOURNAL_GET in a host file while the job is running.
+ *	After power lost, the saved journal is given back by IOCTL_JOURNAL_SET
+ *	before submitting the same image again, then the job checks the rom
+ *	with the crc of the recorded sectors and resumes from the first one
+ *	failed, instead of the whole image.
+ *	the start_addr of the job should be aligned to the rom erase unit.
+ */
+#define	EC_JOURNAL_MAGIC	0x4E4A4345	// "ECJN"
+#define	EC_JOURNAL_SECTORS	(EC_CONTENT_MAX_SIZE / EC_SECTOR_SIZE)
+struct ec_journal {
+	u32 magic;			/* EC_JOURNAL_MAGIC */
+	u32 flag;			/* PROGRAM_FLAG_ROM or PROGRAM_FLAG_IE */
+	u32 start_addr;		/* same as ec_job_req */
+	u32 size;
+	u32 image_crc;		/* crc32 of the whole image */
+	u32 sector_size;	/* rom erase unit */
+	u32 sectors;		/* sectors of the image */
+	u32 done;			/* sectors programmed and verified */
+	u32 crc[EC_JOURNAL_SECTORS];	/* crc32 of the image data in each sector */
+};
+
+/*
+ * erase plan of the programming job for IOCTL_PROGRAM_PLAN :
+ *	the erase units of the image range are checked against the image,
+ *	the units already same as the image or only with 1 bits to clear are
+ *	not erased. The dirty units in one block are erased by one block erase
+ *	if it is faster than the sector erases, with the typical time below.
+ *	chip erase is never chosen for the code and IE share the chip.
+ */
+#define	EC_SECTOR_ERASE_MS		60		// typical time of the 4KB sector erase
+#define	EC_BLOCK_ERASE_MS		700		// typical time of the 64KB block erase
+#define	EC_BYTE_PROGRAM_US		40		// typical time of programming one byte with verify
+#define	EC_PLAN_UNITS_MAX		(EC_CONTENT_MAX_SIZE / EC_SECTOR_SIZE + 1)
+struct ec_erase_step {
+	u32 cmd;		/* SPICMD_XXX_ERASE */
+	u32 addr;		/* rom address */
+	u32 size;
+	u32 est_ms;		/* typical time */
+	u32 actual_ms;	/* time used, 0 before it is done */
+};
+struct ec_erase_plan {
+	u32 steps;		/* erase steps planned */
+	u32 done;		/* erase steps finished */
+	u32 est_ms;		/* typical time of all the steps */
+	u32 actual_ms;	/* time used by the finished steps */
+	struct ec_erase_step step[EC_PLAN_UNITS_MAX];
+};
+
+/*
+ * programming job status for IOCTL_PROGRAM_STATUS, it is the job submitted
+ * on the same file until its result is read once, else the current job.
+ */
+struct ec_job_status {
+	u32 id;			/* job id returned by IOCTL_PROGRAM_SUBMIT */
+	u32 flag;		/* PROGRAM_FLAG_ROM or PROGRAM_FLAG_IE */
+	u32 phase;		/* EC_JOB_PHASE_XXX */
+	u32 total;		/* bytes to program */
+	u32 done;		/* bytes programmed and verified */
+	u32 elapsed;	/* ms since the job started */
+	u32 throughput;	/* bytes per second */
+	s32 error;		/* 0 or negative errno */
+};
+
@@ -11,6 +11,20 @@
 extern unsigned char ec_read(unsigned short addr);
 /* the general ec index-io port write action */
 extern void ec_write(unsigned short addr, unsigned char val);
-/* query sequence of 62/66 port access routine */
+/* read several registers in one pass of index-io */
+extern void ec_read_multi(const unsigned short *addr, unsigned char *val, int count);
+/* query sequence of 62/66 port access routine, -EBUSY if a sleeping query holds the ports */
 extern int ec_query_seq(unsigned char cmd);
+/* the same query polling with sleeping, for the process context */
+extern int ec_query_seq_sleep(unsigned char cmd);
+/* query with the answer of ec read in the same hold of the ports */
+extern int ec_query_read_sleep(unsigned char cmd, unsigned char *val);
 
+/* ec rom access for the flash drivers */
+extern int ec_rom_read(unsigned int addr, unsigned char *buf, unsigned int len);
+/* smallest erase unit of the rom part */
+extern unsigned int ec_rom_erase_size(void);
+/* erase and write keep ec in the programming mode until ec_rom_sync() */
+extern int ec_rom_erase(unsigned int addr, unsigned int len);
+extern int ec_rom_write(unsigned int addr, const unsigned char *buf, unsigned int len);
+extern void ec_rom_sync(void);
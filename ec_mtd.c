@@ -0,0 +1,146 @@
+/*
+ * EC(Embedded Controller) KB3310B SPI ROM MTD driver on Linux
+ *
+ * NOTE :
+ * 		The rom behind the XBI interface of KB3310B is exposed as MTD,
+ * 		so the standard tools(flash_erase, flashcp, nanddump...) can be used.
+ * 		1, the erase unit is probed by ec_misc from the rom jedec id.
+ * 		2, ec stays in the programming mode from the first erase or write
+ * 		   until sync, which is done by mtdchar when the device is closed.
+ * 		3, ec code and IE are exposed as two partitions.
+ */
+
+/*******************************************************************/
+
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/mtd/mtd.h>
+#include <linux/mtd/partitions.h>
+#include <linux/version.h>
+
+#include "ec.h"
+#include "ec_misc.h"
+#include "ec_misc_fn.h"
+
+/*******************************************************************/
+
+static struct mtd_partition ec_mtd_parts[] = {
+	{
+		.name =		"EC code",
+		.offset =	EC_START_ADDR,
+		.size =		EC_CONTENT_MAX_SIZE
+	},
+	{
+		.name =		"EC IE",
+		.offset =	IE_START_ADDR,
+		.size =		EC_CONTENT_MAX_SIZE
+	},
+};
+
+#define EC_MTD_PARTITION_COUNT	ARRAY_SIZE(ec_mtd_parts)
+
+static struct mtd_info ec_mtd;
+
+/*******************************************************************/
+
+static int ec_mtd_read(struct mtd_info *mtd, loff_t from, size_t len,
+		size_t *retlen, u_char *buf)
+{
+	size_t count;
+	int ret = 0;
+
+	*retlen = 0;
+	if(from + len > mtd->size)
+		return -EINVAL;
+
+	/* one page at a time, the rom lock is not held for the whole read */
+	while(*retlen < len){
+		count = min_t(size_t, len - *retlen, PAGE_SIZE);
+		ret = ec_rom_read(from + *retlen, buf + *retlen, count);
+		if(ret < 0)
+			break;
+		*retlen += count;
+	}
+
+	return ret;
+}
+
+static int ec_mtd_write(struct mtd_info *mtd, loff_t to, size_t len,
+		size_t *retlen, const u_char *buf)
+{
+	int ret;
+
+	*retlen = 0;
+	if(to + len > mtd->size)
+		return -EINVAL;
+
+	ret = ec_rom_write(to, buf, len);
+	if(ret < 0)
+		return ret;
+	*retlen = len;
+
+	return 0;
+}
+
+static int ec_mtd_erase(struct mtd_info *mtd, struct erase_info *instr)
+{
+	int ret;
+
+	ret = ec_rom_erase(instr->addr, instr->len);
+	if(ret < 0){
+		printk(KERN_ERR "EC MTD : erase 0x%x bytes at 0x%x failed.\n",
+				(unsigned int)instr->len, (unsigned int)instr->addr);
+		instr->state = MTD_ERASE_FAILED;
+		return -EIO;
+	}
+
+	instr->state = MTD_ERASE_DONE;
+	mtd_erase_callback(instr);
+
+	return 0;
+}
+
+/* make ec back to the normal mode after erasing and writing */
+static void ec_mtd_sync(struct mtd_info *mtd)
+{
+	ec_rom_sync();
+}
+
+/*******************************************************************/
+
+static int __init ec_mtd_init(void)
+{
+	ec_mtd.name = "ec_rom";
+	ec_mtd.type = MTD_NORFLASH;
+	ec_mtd.flags = MTD_CAP_NORFLASH;
+	ec_mtd.size = EC_FLASH_SIZE;
+	ec_mtd.erasesize = ec_rom_erase_size();
+	ec_mtd.writesize = 1;
+	ec_mtd.read = ec_mtd_read;
+	ec_mtd.write = ec_mtd_write;
+	ec_mtd.erase = ec_mtd_erase;
+	ec_mtd.sync = ec_mtd_sync;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	ec_mtd.owner = THIS_MODULE;
+#endif
+
+	printk(KERN_NOTICE "EC MTD : rom 0x%x bytes, erase unit 0x%x.\n",
+			(unsigned int)ec_mtd.size, ec_mtd.erasesize);
+
+	return add_mtd_partitions(&ec_mtd, ec_mtd_parts, EC_MTD_PARTITION_COUNT);
+}
+
+static void __exit ec_mtd_exit(void)
+{
+	del_mtd_partitions(&ec_mtd);
+	/* never leave ec in the programming mode */
+	ec_rom_sync();
+}
+
+module_init(ec_mtd_init);
+module_exit(ec_mtd_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("MTD driver for KB3310 EC SPI ROM");
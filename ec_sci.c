@@ -3,9 +3,13 @@
  * Author	: liujl <liujl@lemote.com>
  * Date		: 2008-10-22
  *
- * NOTE : Until now, I have no idea for setting the interrupt to edge sensitive
- *	mode, amd's help should be needed for handling this problem
- *	So, I assume that the interrupt width is 120us
+ * NOTE : The positive edge of GPIO27 is latched in the edge status, so the
+ *	interrupt handler can tell the sci from the other devices sharing
+ *	the irq line, the interrupt width is about 120us.
+ *	The interrupt handler only masks the GPIO27 event, the query of the
+ *	event number and the parsing run in the irq thread(workqueue before
+ *	2.6.30), then the event is unmasked again.
+ *	The hotkeys, lid and crt are reported as input events too.
  */
 
 /***********************************************************************/
@@ -32,6 +36,11 @@
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/input.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <asm/delay.h>
 #include "ec.h"
 #include "ec_misc_fn.h"
@@ -42,6 +51,26 @@
 #define	EC_SCI_DEV			"sci"
 #define	SCI_IRQ_NUM			0x0A
 #define	CS5536_GPIO_SIZE	256
+/* gpio high bank event enable register, GPIO27 is bit 11 of the bank,
+ * the low half of the value sets the bit and the high half clears it */
+#define	GPIOH_EVNT_EN		0xB8
+#define	GPIO27_EVNT_ON		0x00000800
+#define	GPIO27_EVNT_OFF		0x08000000
+/* positive edge detection of the high bank, the status is cleared by 1 */
+#define	GPIOH_POSEDGE_EN	0xC0
+#define	GPIOH_POSEDGE_STS	0xC8
+#define	GPIO27_EDGE_BIT		0x00000800
+
+/* records in the event ring, power of 2 */
+#define	SCI_RING_SIZE		64
+
+/*
+ * brightness & volume events in the same direction are merged within it,
+ * off by default for the /proc/sci line has no count of the merged events.
+ */
+static int coalesce_ms;
+module_param(coalesce_ms, int, 0644);
+MODULE_PARM_DESC(coalesce_ms, "window in ms to merge the brightness and volume events, 0 for none (default), /proc/sci readers lose the merged steps");
 
 /* ec delay time 500us for register and status access */
 /* unit : us */
@@ -63,7 +92,27 @@ struct sci_device {
 
 	/* irq relative */
 	unsigned char irq;
-	unsigned char irq_data;
+
+	/*
+	 * ring of the events, written and read with lock, only the numbers
+	 * are peeked without it, see sci_ring_push() and sci_ring_get().
+	 */
+	struct sci_event_record ring[SCI_RING_SIZE];
+	u32 head;			/* seq of the next record */
+	atomic_t overflow;	/* records overwritten before being read */
+
+	/* brightness & volume record being merged, pushed by the timer */
+	struct sci_event_record pending;
+	int pending_valid;
+	struct timer_list coalesce_timer;
+	/* level of the brightness & volume event parsed */
+	unsigned char level;
+
+	/* hotkeys, lid and crt for the input subsystem */
+	struct input_dev *input;
+
+	/* time of the interrupt entry for the event handled, in ns */
+	u64 irq_ns;
 
 	/* device name */
 	unsigned char name[10];
@@ -72,9 +121,15 @@ struct sci_device {
 	unsigned long gpio_base;
 	unsigned long gpio_size;
 
-	/* lock & wait_queue */
-	wait_queue_head_t wq;
+	/* lock & the readers opened */
+	struct list_head readers;
 	spinlock_t lock;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	/* bottom half of the interrupt without the irq thread */
+	struct workqueue_struct *event_wq;
+	struct work_struct event_work;
+#endif
 	
 	/* storage initial value of sci status register 
 	 * sci_init_value[0] as brightness
@@ -84,15 +139,29 @@ struct sci_device {
 };
 struct sci_device *sci_device;
 
+/* each open file of /dev/sci and /proc/sci reads the events on its own */
+struct sci_reader {
+	struct list_head list;
+	u32 seq;			/* seq of the next record */
+	u32 mask;			/* SCI_EVENT_BIT() of the events subscribed */
+	u32 lost;			/* records subscribed but overwritten before read */
+	struct mutex lock;	/* serializes the reads on the file */
+	wait_queue_head_t wq;
+};
+
 #ifdef	CONFIG_PROC_FS
 static ssize_t sci_proc_read(struct file *file, char *buf, size_t len, loff_t *ppos);
 static ssize_t sci_proc_write(struct file *file, const char *buf, size_t len, loff_t *ppos);
 static unsigned int sci_poll(struct file *fp, poll_table *wait);
+static int sci_open(struct inode * inode, struct file * filp);
+static int sci_release(struct inode * inode, struct file * filp);
 static struct proc_dir_entry *sci_proc_entry;
 static struct file_operations sci_proc_fops = {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
 	owner :	THIS_MODULE,
 #endif
+	open  : sci_open,
+	release : sci_release,
 	read  : sci_proc_read,
 	poll  : sci_poll,
 	write : sci_proc_write,
@@ -377,12 +446,410 @@ static void sci_machine_reset(void)
 	return;
 }
 
+/*******************************************************************/
+
+/*
+ * latency statistics of the sci path, for each event number the time from
+ * the interrupt entry to the end of the query, the time of the parsing and
+ * the time from the interrupt entry until a reader takes the record.
+ * the histograms are log2 of us, bucket i for [2^(i-1), 2^i) us.
+ */
+#define	SCI_STAT_BUCKETS	24
+#define	SCI_STAT_EVENTS		(SCI_EVENT_NUM_WLAN - SCI_EVENT_NUM_BASE + 1)
+
+enum {
+	SCI_STAT_QUERY = 0,
+	SCI_STAT_PARSE,
+	SCI_STAT_DEQUEUE,
+	SCI_STAT_STAGES
+};
+
+static const char *sci_stat_stage_name[SCI_STAT_STAGES] = {
+	"query", "parse", "dequeue"
+};
+
+struct sci_stat_hist {
+	u32 count;
+	u32 max_us;
+	u32 bucket[SCI_STAT_BUCKETS];
+};
+
+struct sci_stats {
+	u32 spurious_irq;	/* interrupts not of sci */
+	u32 query_timeout;	/* no event number from ec */
+	u32 number_00;		/* event number 0x00 */
+	u32 number_ff;		/* event number 0xff */
+	u32 parse_failed;	/* event number not supported */
+	struct sci_stat_hist hard_irq;	/* time in sci_int_routine */
+	struct sci_stat_hist event[SCI_STAT_EVENTS][SCI_STAT_STAGES];
+};
+static struct sci_stats sci_stats;
+static DEFINE_SPINLOCK(sci_stats_lock);
+
+static void sci_stat_hist_add(struct sci_stat_hist *hist, u64 ns)
+{
+	u32 us;
+	int i;
+
+	do_div(ns, 1000);
+	us = (ns > 0xffffffffULL) ? 0xffffffff : (u32)ns;
+	i = fls(us);
+	if(i >= SCI_STAT_BUCKETS)
+		i = SCI_STAT_BUCKETS - 1;
+	hist->bucket[i]++;
+	hist->count++;
+	if(us > hist->max_us)
+		hist->max_us = us;
+}
+
+/* time from start until now, for the stage of the event number */
+static void sci_stat_event(unsigned char number, int stage, u64 start)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long flags;
+
+	if( (number < SCI_EVENT_NUM_BASE) || (number - SCI_EVENT_NUM_BASE >= SCI_STAT_EVENTS) )
+		return;
+	spin_lock_irqsave(&sci_stats_lock, flags);
+	sci_stat_hist_add(&sci_stats.event[number - SCI_EVENT_NUM_BASE][stage],
+			now > start ? now - start : 0);
+	spin_unlock_irqrestore(&sci_stats_lock, flags);
+}
+
+static void sci_stat_hard_irq(u64 start)
+{
+	u64 now = ktime_to_ns(ktime_get());
+	unsigned long flags;
+
+	spin_lock_irqsave(&sci_stats_lock, flags);
+	sci_stat_hist_add(&sci_stats.hard_irq, now > start ? now - start : 0);
+	spin_unlock_irqrestore(&sci_stats_lock, flags);
+}
+
+/* counters of sci_stats */
+#define	sci_stat_inc(field)		do {	\
+	unsigned long __flags;	\
+	spin_lock_irqsave(&sci_stats_lock, __flags);	\
+	sci_stats.field++;	\
+	spin_unlock_irqrestore(&sci_stats_lock, __flags);	\
+} while(0)
+
+#ifdef	CONFIG_DEBUG_FS
+static struct dentry *sci_debugfs_dir;
+
+static void sci_stat_hist_show(struct seq_file *m, const char *name, struct sci_stat_hist *hist)
+{
+	int i;
+
+	seq_printf(m, "  %-8s count %u max %uus |", name, hist->count, hist->max_us);
+	for(i = 0; i < SCI_STAT_BUCKETS; i++){
+		if(hist->bucket[i])
+			seq_printf(m, " <%uus:%u", 1U << i, hist->bucket[i]);
+	}
+	seq_puts(m, "\n");
+}
+
+static int sci_stats_show(struct seq_file *m, void *v)
+{
+	struct sci_stats *stats;
+	unsigned long flags;
+	int i, j;
+
+	/* a copy for not holding the lock while printing */
+	stats = kmalloc(sizeof(struct sci_stats), GFP_KERNEL);
+	if(stats == NULL)
+		return -ENOMEM;
+	spin_lock_irqsave(&sci_stats_lock, flags);
+	memcpy(stats, &sci_stats, sizeof(struct sci_stats));
+	spin_unlock_irqrestore(&sci_stats_lock, flags);
+
+	seq_printf(m, "spurious irq  : %u\n", stats->spurious_irq);
+	seq_printf(m, "query timeout : %u\n", stats->query_timeout);
+	seq_printf(m, "number 0x00   : %u\n", stats->number_00);
+	seq_printf(m, "number 0xff   : %u\n", stats->number_ff);
+	seq_printf(m, "parse failed  : %u\n", stats->parse_failed);
+	sci_stat_hist_show(m, "hard irq", &stats->hard_irq);
+	for(i = 0; i < SCI_STAT_EVENTS; i++){
+		if(!stats->event[i][SCI_STAT_QUERY].count)
+			continue;
+		seq_printf(m, "event 0x%02x :\n", i + SCI_EVENT_NUM_BASE);
+		for(j = 0; j < SCI_STAT_STAGES; j++)
+			sci_stat_hist_show(m, sci_stat_stage_name[j], &stats->event[i][j]);
+	}
+	kfree(stats);
+
+	return 0;
+}
+
+static int sci_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sci_stats_show, NULL);
+}
+
+/* any write clears the statistics */
+static ssize_t sci_stats_write(struct file *file, const char __user *buf, size_t len, loff_t *ppos)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&sci_stats_lock, flags);
+	memset(&sci_stats, 0, sizeof(struct sci_stats));
+	spin_unlock_irqrestore(&sci_stats_lock, flags);
+
+	return len;
+}
+
+static const struct file_operations sci_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= sci_stats_open,
+	.read		= seq_read,
+	.write		= sci_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+#endif
+
+/*******************************************************************/
+
+/* the reader subscribes the event or not */
+static inline int sci_reader_wants(struct sci_reader *reader, unsigned char number)
+{
+	if( (number < SCI_EVENT_NUM_BASE) || (number >= SCI_EVENT_NUM_BASE + 32) )
+		return 0;
+	return (ACCESS_ONCE(reader->mask) & SCI_EVENT_BIT(number)) != 0;
+}
+
+/*
+ * sci_ring_push :
+ *	put the record in the ring, the oldest record is overwritten when
+ *	the ring is full. it is counted as lost only for the readers which
+ *	subscribe it and have not read it, the records not subscribed never
+ *	count as the overflow of the reader.
+ *	should be called with sci_device->lock.
+ */
+static void sci_ring_push(struct sci_device *sci_device, const struct sci_event_record *new)
+{
+	struct sci_event_record *rec = &sci_device->ring[sci_device->head % SCI_RING_SIZE];
+	struct sci_reader *reader;
+
+	list_for_each_entry(reader, &sci_device->readers, list){
+		if( ((s32)(reader->seq - rec->seq) <= 0) && sci_reader_wants(reader, rec->number) )
+			reader->lost++;
+	}
+
+	rec->seq = sci_device->head;
+	rec->time_ns = new->time_ns;
+	rec->number = new->number;
+	rec->count = new->count;
+	rec->level = new->level;
+	rec->reserved = 0;
+	memcpy(rec->state, new->state, SCI_MAX_EVENT_COUNT);
+	/* for sci_reader_pending() peeking the number */
+	smp_wmb();
+	sci_device->head++;
+}
+
+/*
+ * sci_ring_get :
+ *	copy the record of *seq out and move *seq on, 0 is returned if there
+ *	is no new record. the reader too late for the records overwritten is
+ *	moved to the oldest one kept, sci_ring_push() has counted the lost.
+ *	should be called with sci_device->lock.
+ */
+static int sci_ring_get(struct sci_device *sci_device, u32 *seq, struct sci_event_record *rec)
+{
+	u32 head = sci_device->head;
+
+	if(*seq == head)
+		return 0;
+	if(head - *seq > SCI_RING_SIZE)
+		*seq = head - SCI_RING_SIZE;
+	*rec = sci_device->ring[*seq % SCI_RING_SIZE];
+	(*seq)++;
+
+	return 1;
+}
+
+/*
+ * any record subscribed for the reader, the numbers are only peeked here
+ * without the lock, sci_reader_next() takes the records with it.
+ */
+static int sci_reader_pending(struct sci_reader *reader)
+{
+	u32 head = ACCESS_ONCE(sci_device->head);
+	u32 seq = reader->seq;
+
+	if(head - seq > SCI_RING_SIZE)
+		return 1;
+	for(; seq != head; seq++){
+		if(sci_reader_wants(reader, sci_device->ring[seq % SCI_RING_SIZE].number))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* take the next record subscribed by the reader, 0 if none */
+static int sci_reader_next(struct sci_reader *reader, struct sci_event_record *rec)
+{
+	unsigned long flags;
+	u32 lost;
+	int ret;
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	while( (ret = sci_ring_get(sci_device, &reader->seq, rec)) ){
+		if(sci_reader_wants(reader, rec->number))
+			break;
+	}
+	lost = reader->lost;
+	reader->lost = 0;
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+
+	if(lost){
+		atomic_add(lost, &sci_device->overflow);
+		if(printk_ratelimit())
+			printk(KERN_WARNING "EC SCI : %u events lost by the slow reader.\n", lost);
+	}
+	if(ret)
+		sci_stat_event(rec->number, SCI_STAT_DEQUEUE, rec->time_ns);
+
+	return ret;
+}
+
+/* wake the readers subscribing the event */
+static void sci_wake_readers(unsigned char number)
+{
+	struct sci_reader *reader;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	list_for_each_entry(reader, &sci_device->readers, list){
+		if(sci_reader_wants(reader, number))
+			wake_up_interruptible(&reader->wq);
+	}
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+}
+
+/* push the merged record when the window is over */
+static void sci_coalesce_timeout(unsigned long data)
+{
+	unsigned long flags;
+	unsigned char number = 0;
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	if(sci_device->pending_valid){
+		sci_ring_push(sci_device, &sci_device->pending);
+		sci_device->pending_valid = 0;
+		number = sci_device->pending.number;
+	}
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+
+	if(number)
+		sci_wake_readers(number);
+}
+
+/*
+ * sci_queue_event :
+ *	record the event parsed. the brightness & volume events are kept for
+ *	coalesce_ms, and the next ones in the same direction are merged into
+ *	the record with the count and the last level. the other events go to
+ *	the ring at once, after the record being merged for the order.
+ */
+static void sci_queue_event(struct sci_device *sci_device)
+{
+	struct sci_event_record rec;
+	unsigned char flushed = 0;
+	unsigned long flags;
+	int coalesce;
+
+	rec.time_ns = sci_device->irq_ns;
+	rec.number = sci_device->sci_number;
+	rec.count = 1;
+	rec.level = sci_device->level;
+	memcpy(rec.state, sci_device->sci_num_array, SCI_MAX_EVENT_COUNT);
+	coalesce = (coalesce_ms > 0) && ( (rec.number == SCI_EVENT_NUM_DISPLAY_BRIGHTNESS)
+		|| (rec.number == SCI_EVENT_NUM_AUDIO_VOLUME) );
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	if(sci_device->pending_valid){
+		/* the direction is in the state */
+		if( coalesce && (sci_device->pending.number == rec.number)
+			&& !memcmp(sci_device->pending.state, rec.state, SCI_MAX_EVENT_COUNT)
+			&& (sci_device->pending.count < 0xff) ){
+			sci_device->pending.count++;
+			sci_device->pending.level = rec.level;
+			sci_device->pending.time_ns = rec.time_ns;
+			spin_unlock_irqrestore(&sci_device->lock, flags);
+			return;
+		}
+		sci_ring_push(sci_device, &sci_device->pending);
+		sci_device->pending_valid = 0;
+		flushed = sci_device->pending.number;
+	}
+	if(coalesce){
+		sci_device->pending = rec;
+		sci_device->pending_valid = 1;
+		mod_timer(&sci_device->coalesce_timer, jiffies + msecs_to_jiffies(coalesce_ms));
+	}else{
+		sci_ring_push(sci_device, &rec);
+	}
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+
+	if(flushed)
+		sci_wake_readers(flushed);
+	if(!coalesce)
+		sci_wake_readers(rec.number);
+}
+
+/*
+ * sci_wait_record :
+ *	take the next record for the reader, wait for it unless nonblock.
+ *	should be called with the lock of the reader.
+ */
+static int sci_wait_record(struct sci_reader *reader, struct sci_event_record *rec, int nonblock)
+{
+	int ret;
+
+	while(!sci_reader_next(reader, rec)){
+		if(nonblock)
+			return -EAGAIN;
+		ret = wait_event_interruptible(reader->wq, sci_reader_pending(reader));
+		if(ret)
+			return ret;
+	}
+	PRINTK_DBG("debug..... seq %d, number 0x%x\n", rec->seq, rec->number);
+
+	return 0;
+}
+
 /*******************************************************************/
 static const char driver_version[] = VERSION;
 
 #ifdef CONFIG_PROC_FS
 #define	PROC_BUF_SIZE	128
-unsigned char proc_buf[PROC_BUF_SIZE];
+
+/* format the line of the event state, it has the same length for any state */
+static int sci_proc_format(char *text, const unsigned char *event)
+{
+	return snprintf(text, PROC_BUF_SIZE, 
+			"%s 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x "
+			"0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x "
+			"0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n", 
+			driver_version, event[SCI_INDEX_DISPLAY_BRIGHTNESS_INC], 
+			event[SCI_INDEX_DISPLAY_BRIGHTNESS_DEC], event[SCI_INDEX_AUDIO_VOLUME_INC], 
+			event[SCI_INDEX_AUDIO_VOLUME_DEC], event[SCI_INDEX_AUDIO_MUTE], 
+			event[SCI_INDEX_WLAN], event[SCI_INDEX_LID], 
+			event[SCI_INDEX_DISPLAY_TOGGLE], event[SCI_INDEX_BLACK_SCREEN], 
+			event[SCI_INDEX_SLEEP], event[SCI_INDEX_OVERTEMP], 
+			event[SCI_INDEX_CRT_DETECT], event[SCI_INDEX_CAMERA], 
+			event[SCI_INDEX_USB_OC2], event[SCI_INDEX_USB_OC0], 
+			(event[SCI_INDEX_AC_BAT] & 0x01) >> BIT_AC_BAT_BAT_IN, 
+			(event[SCI_INDEX_AC_BAT] & 0x02) >> BIT_AC_BAT_AC_IN, 
+			(event[SCI_INDEX_AC_BAT] & 0x04) >> BIT_AC_BAT_INIT_CAP,	
+			(event[SCI_INDEX_AC_BAT] & 0x08) >> BIT_AC_BAT_CHARGE_MODE,	
+			(event[SCI_INDEX_AC_BAT] & 0x10) >> BIT_AC_BAT_STOP_CHARGE,	
+			(event[SCI_INDEX_AC_BAT] & 0x20) >> BIT_AC_BAT_BAT_LOW,
+			(event[SCI_INDEX_AC_BAT] & 0x40) >> BIT_AC_BAT_BAT_FULL);
+}
 
 /*
  * sci_proc_read :
@@ -411,68 +878,39 @@ unsigned char proc_buf[PROC_BUF_SIZE];
  *	STOP CHARGE
  *	BAT LOW
  *	BAT FULL
+ *	the line is formatted from the next event record for each read, the
+ *	records can be read in binary by read() on /dev/sci instead.
  */
 static ssize_t sci_proc_read(struct file *file, char *buf, size_t len, loff_t *ppos)
 {
-	unsigned char event[SCI_MAX_EVENT_COUNT];
-	int ret = 0;
-	int i;
+	struct sci_reader *reader = file->private_data;
+	struct sci_event_record rec;
+	char text[PROC_BUF_SIZE];
 	int count = 0;
-	DECLARE_WAITQUEUE(wait, current);
-	
-	PRINTK_DBG("0 irq_data %d\n", sci_device->irq_data);
-
-	if (sci_device->irq_data == 0) {
-		add_wait_queue(&(sci_device->wq), &wait);
-
-		while (!sci_device->irq_data) {
-			set_current_state(TASK_INTERRUPTIBLE);
-			schedule();
-		}
-		remove_wait_queue(&(sci_device->wq), &wait);
-	}
-
-
-	PRINTK_DBG("1 irq_data %d\n", sci_device->irq_data);
-	__set_current_state(TASK_RUNNING);
+	int ret;
 
-	for(i = 0; i < SCI_MAX_EVENT_COUNT; i++){
-		event[i] = sci_device->sci_num_array[i];
+	/* the buffer is checked before the record is taken, so it is not lost */
+	memset(rec.state, 0, SCI_MAX_EVENT_COUNT);
+	count = sci_proc_format(text, rec.state);
+	if(count >= PROC_BUF_SIZE){
+		printk(KERN_ERR "EC SCI : proc line truncated.\n");
+		return -EOVERFLOW;
 	}
-	PRINTK_DBG("debug..... sci_num_array[0] = %d, event[0] %d\n", sci_device->sci_num_array[0], event[0]);
-
-	ret = sprintf(proc_buf, 
-			"%s 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x "
-			"0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x "
-			"0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x 0x%02x\n", 
-			driver_version, event[SCI_INDEX_DISPLAY_BRIGHTNESS_INC], 
-			event[SCI_INDEX_DISPLAY_BRIGHTNESS_DEC], event[SCI_INDEX_AUDIO_VOLUME_INC], 
-			event[SCI_INDEX_AUDIO_VOLUME_DEC], event[SCI_INDEX_AUDIO_MUTE], 
-			event[SCI_INDEX_WLAN], event[SCI_INDEX_LID], 
-			event[SCI_INDEX_DISPLAY_TOGGLE], event[SCI_INDEX_BLACK_SCREEN], 
-			event[SCI_INDEX_SLEEP], event[SCI_INDEX_OVERTEMP], 
-			event[SCI_INDEX_CRT_DETECT], event[SCI_INDEX_CAMERA], 
-			event[SCI_INDEX_USB_OC2], event[SCI_INDEX_USB_OC0], 
-			(event[SCI_INDEX_AC_BAT] & 0x01) >> BIT_AC_BAT_BAT_IN, 
-			(event[SCI_INDEX_AC_BAT] & 0x02) >> BIT_AC_BAT_AC_IN, 
-			(event[SCI_INDEX_AC_BAT] & 0x04) >> BIT_AC_BAT_INIT_CAP,	
-			(event[SCI_INDEX_AC_BAT] & 0x08) >> BIT_AC_BAT_CHARGE_MODE,	
-			(event[SCI_INDEX_AC_BAT] & 0x10) >> BIT_AC_BAT_STOP_CHARGE,	
-			(event[SCI_INDEX_AC_BAT] & 0x20) >> BIT_AC_BAT_BAT_LOW,
-			(event[SCI_INDEX_AC_BAT] & 0x40) >> BIT_AC_BAT_BAT_FULL);
-
-	count = strlen(proc_buf);
-	sci_device->irq_data = 0;
-
 	if(len < count)	
 		return -ENOMEM;
-	if(PROC_BUF_SIZE < count)
-		return -ENOMEM;
 
-	if(copy_to_user(buf, proc_buf, count))
+	if(mutex_lock_interruptible(&reader->lock))
+		return -ERESTARTSYS;
+	ret = sci_wait_record(reader, &rec, file->f_flags & O_NONBLOCK);
+	mutex_unlock(&reader->lock);
+	if(ret)
+		return ret;
+
+	count = sci_proc_format(text, rec.state);
+	if(copy_to_user(buf, text, count))
 		return -EFAULT;
 	
-	PRINTK_DBG("debug2..... proc_buf %s\n", proc_buf);
+	PRINTK_DBG("debug2..... text %s\n", text);
 	return count;
 }
 
@@ -482,10 +920,11 @@ static ssize_t sci_proc_read(struct file *file, char *buf, size_t len, loff_t *p
  */
 static ssize_t sci_proc_write(struct file *file, const char *buf, size_t len, loff_t *ppos)
 {
+	char proc_buf[PROC_BUF_SIZE];
 	int i;
 	//int level;
 	
-	if(len > PROC_BUF_SIZE){
+	if(len >= PROC_BUF_SIZE){
 		PRINTK_DBG("err: size too big\n");
 		return -ENOMEM;
 	}
@@ -613,80 +1052,140 @@ static ssize_t sci_proc_write(struct file *file, const char *buf, size_t len, lo
 
 /*
  * sci_query_event_num :
- *	using query command to ec to get the proper event number
+ *	using query command to ec to get the proper event number,
+ *	ec is polled with sleeping for it runs in the bottom half.
  */
 static int sci_query_event_num(void)
 {
 	int ret = 0;
 
-	ret = ec_query_seq(CMD_GET_EVENT_NUM);
+	ret = ec_query_seq_sleep(CMD_GET_EVENT_NUM);
 	return ret;
 }
 
 /*
  * sci_get_event_num :
- *	get sci event number from ec
- *	NOTE : this routine must follow the sci_query_event_num 
- *	function in the interrupt
+ *	query ec and get the sci event number, the command and the read
+ *	of the number are one transaction on the ports.
  */
 static int sci_get_event_num(void)
 {
-	int timeout = 100;
 	unsigned char value;
-	unsigned char status;
-	
-	udelay(EC_REG_DELAY);
-	status = inb(EC_STS_PORT);
-	udelay(EC_REG_DELAY);
-	while(timeout--){
-		if(!(status & (1 << 0))){
-			status = inb(EC_STS_PORT);
-			udelay(EC_REG_DELAY);
-			continue;
-		}
-		break;
-	}
-	if(timeout <= 0){
+	int ret;
+
+	ret = ec_query_read_sleep(CMD_GET_EVENT_NUM, &value);
+	if(ret < 0){
 		PRINTK_DBG("fixup sci : get event number timeout.\n");
-		return -EINVAL;
+		return ret;
 	}
-	value = inb(EC_DAT_PORT);
-	udelay(EC_REG_DELAY);
 
 	return value;
 }
 
+/*
+ * registers read for each event, only the state of the event is refreshed
+ * and the others are kept as they were, so most events cost one read.
+ */
+#define	SCI_EVENT_REGS_MAX	4
+struct sci_event_regs {
+	unsigned char number;
+	unsigned char count;
+	unsigned short addr[SCI_EVENT_REGS_MAX];
+};
+
+static const struct sci_event_regs sci_event_regs[] = {
+	{ SCI_EVENT_NUM_LID,				1, { REG_LID_DETECT } },
+	{ SCI_EVENT_NUM_DISPLAY_TOGGLE,		0, { } },
+	{ SCI_EVENT_NUM_SLEEP,				0, { } },
+	{ SCI_EVENT_NUM_OVERTEMP,			1, { REG_BAT_CHARGE_STATUS } },
+	{ SCI_EVENT_NUM_CRT_DETECT,			1, { REG_CRT_DETECT } },
+	{ SCI_EVENT_NUM_CAMERA,				0, { } },
+	{ SCI_EVENT_NUM_USB_OC2,			1, { REG_USB2_FLAG } },
+	{ SCI_EVENT_NUM_USB_OC0,			1, { REG_USB0_FLAG } },
+	{ SCI_EVENT_NUM_AC_BAT,				4, { REG_BAT_STATUS, REG_BAT_POWER,
+											REG_BAT_CHARGE_STATUS, REG_BAT_STATE } },
+	{ SCI_EVENT_NUM_DISPLAY_BRIGHTNESS,	1, { REG_DISPLAY_BRIGHTNESS } },
+	{ SCI_EVENT_NUM_AUDIO_VOLUME,		1, { REG_AUDIO_VOLUME } },
+	{ SCI_EVENT_NUM_WLAN,				1, { REG_WLAN_STATUS } },
+	{ SCI_EVENT_NUM_AUDIO_MUTE,			1, { REG_AUDIO_MUTE } },
+	{ SCI_EVENT_NUM_BLACK_SCREEN,		1, { REG_DISPLAY_LCD } },
+};
+
+/* registers of the state kept between the events, read once at init */
+static const unsigned short sci_state_regs[] = {
+	REG_WLAN_STATUS, REG_AUDIO_MUTE, REG_DISPLAY_LCD, REG_CRT_DETECT,
+	REG_LID_DETECT, REG_BAT_POWER, REG_DISPLAY_BRIGHTNESS, REG_AUDIO_VOLUME
+};
+
+static const struct sci_event_regs *sci_event_lookup(unsigned char number)
+{
+	int i;
+
+	for(i = 0; i < ARRAY_SIZE(sci_event_regs); i++){
+		if(sci_event_regs[i].number == number)
+			return &sci_event_regs[i];
+	}
+
+	return NULL;
+}
+
+/* set or clear the bit of AC_BAT state */
+static inline void sci_ac_bat_bit(struct sci_device *sci_device, int bit, int on)
+{
+	if(on){
+		sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << bit;
+	}else{
+		sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << bit);
+	}
+}
+
+/* the state kept between the events and the initial brightness & volume */
+static void sci_init_state(struct sci_device *sci_device)
+{
+	unsigned char val[ARRAY_SIZE(sci_state_regs)];
+
+	ec_read_multi(sci_state_regs, val, ARRAY_SIZE(sci_state_regs));
+	sci_device->sci_num_array[SCI_INDEX_WLAN] = val[0];
+	sci_device->sci_num_array[SCI_INDEX_AUDIO_MUTE] = val[1];
+	sci_device->sci_num_array[SCI_INDEX_BLACK_SCREEN] = val[2];
+	sci_device->sci_num_array[SCI_INDEX_CRT_DETECT] = val[3];
+	sci_device->sci_num_array[SCI_INDEX_LID] = val[4];
+	sci_ac_bat_bit(sci_device, BIT_AC_BAT_AC_IN, val[5] & BIT_BAT_POWER_ACIN);
+	sci_device->sci_init_value[0] = val[6];
+	sci_device->sci_init_value[1] = val[7];
+}
+
 /*
  * sci_parse_num :
  *	parse the event number routine, and store all the information
  *	to the sci_num_array[] for upper layer using
+ *	the registers of the event are read in one pass.
  */
 static int sci_parse_num(struct sci_device *sci_device)
 {
-	unsigned char val;
+	const struct sci_event_regs *regs;
+	unsigned char val[SCI_EVENT_REGS_MAX];
+
+	regs = sci_event_lookup(sci_device->sci_number);
+	if(regs == NULL){
+		PRINTK_DBG(KERN_ERR "EC SCI : not supported SCI NUMBER.\n");
+		return -EINVAL;
+	}
+	ec_read_multi(regs->addr, val, regs->count);
+	sci_device->level = 0;
 
+	/* the flags of the former event */
 	sci_device->sci_num_array[SCI_INDEX_DISPLAY_TOGGLE] = 0x0;
 	sci_device->sci_num_array[SCI_INDEX_SLEEP] = 0x0;
 	sci_device->sci_num_array[SCI_INDEX_DISPLAY_BRIGHTNESS_DEC] = 0;
 	sci_device->sci_num_array[SCI_INDEX_DISPLAY_BRIGHTNESS_INC] = 0;
 	sci_device->sci_num_array[SCI_INDEX_AUDIO_VOLUME_INC] = 0;
 	sci_device->sci_num_array[SCI_INDEX_AUDIO_VOLUME_DEC] = 0;
-
 	sci_device->sci_num_array[SCI_INDEX_CAMERA] = 0x0;
-	sci_device->sci_num_array[SCI_INDEX_WLAN] = ec_read(REG_WLAN_STATUS);
-	sci_device->sci_num_array[SCI_INDEX_AUDIO_MUTE] = ec_read(REG_AUDIO_MUTE);
-	sci_device->sci_num_array[SCI_INDEX_BLACK_SCREEN] = ec_read(REG_DISPLAY_LCD);
-	sci_device->sci_num_array[SCI_INDEX_CRT_DETECT] = ec_read(REG_CRT_DETECT);
-	sci_device->sci_num_array[SCI_INDEX_LID] = ec_read(REG_LID_DETECT);
-	if( ec_read(REG_BAT_POWER) & BIT_BAT_POWER_ACIN ){
-		sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_AC_IN;
-	}else{
-		sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_AC_IN);
-	}
 
 	switch(sci_device->sci_number){
 		case	SCI_EVENT_NUM_LID :
-			sci_device->sci_num_array[SCI_INDEX_LID] = ec_read(REG_LID_DETECT);
+			sci_device->sci_num_array[SCI_INDEX_LID] = val[0];
 			break;
 		case	SCI_EVENT_NUM_DISPLAY_TOGGLE :
 			sci_device->sci_num_array[SCI_INDEX_DISPLAY_TOGGLE] = 0x01;
@@ -695,93 +1194,59 @@ static int sci_parse_num(struct sci_device *sci_device)
 			sci_device->sci_num_array[SCI_INDEX_SLEEP] = 0x01;
 			break;
 		case	SCI_EVENT_NUM_OVERTEMP :
-			sci_device->sci_num_array[SCI_INDEX_OVERTEMP] = (ec_read(REG_BAT_CHARGE_STATUS) & BIT_BAT_CHARGE_STATUS_OVERTEMP) >> 2;
+			sci_device->sci_num_array[SCI_INDEX_OVERTEMP] = (val[0] & BIT_BAT_CHARGE_STATUS_OVERTEMP) >> 2;
 			break;
 		case	SCI_EVENT_NUM_CRT_DETECT :
-			sci_device->sci_num_array[SCI_INDEX_CRT_DETECT] = ec_read(REG_CRT_DETECT);
+			sci_device->sci_num_array[SCI_INDEX_CRT_DETECT] = val[0];
 			break;
 		case	SCI_EVENT_NUM_CAMERA :
 			sci_device->sci_num_array[SCI_INDEX_CAMERA] = 0x1;
 			break;
 		case	SCI_EVENT_NUM_USB_OC2 :
-			sci_device->sci_num_array[SCI_INDEX_USB_OC2] = ec_read(REG_USB2_FLAG);
+			sci_device->sci_num_array[SCI_INDEX_USB_OC2] = val[0];
 			break;
 		case	SCI_EVENT_NUM_USB_OC0 :
-			sci_device->sci_num_array[SCI_INDEX_USB_OC0] = ec_read(REG_USB0_FLAG);
+			sci_device->sci_num_array[SCI_INDEX_USB_OC0] = val[0];
 			break;
 		case	SCI_EVENT_NUM_AC_BAT :
-			if( ec_read(REG_BAT_STATUS) & BIT_BAT_STATUS_IN ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_BAT_IN;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_BAT_IN);
-			}
-			
-			if( ec_read(REG_BAT_POWER) & BIT_BAT_POWER_ACIN ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_AC_IN;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_AC_IN);
-			}
-			
+			/* val : REG_BAT_STATUS, REG_BAT_POWER, REG_BAT_CHARGE_STATUS, REG_BAT_STATE */
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_BAT_IN, val[0] & BIT_BAT_STATUS_IN);
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_AC_IN, val[1] & BIT_BAT_POWER_ACIN);
 			/* init_bat_cap will not be included here. */
-
-			if( ec_read(REG_BAT_CHARGE_STATUS) & BIT_BAT_CHARGE_STATUS_PRECHG ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_CHARGE_MODE;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_CHARGE_MODE);
-			}
-
-			if( ec_read(REG_BAT_STATE) & BIT_BAT_STATE_DISCHARGING ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_STOP_CHARGE;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_STOP_CHARGE);
-			}
-
-			if( ec_read(REG_BAT_STATUS) & BIT_BAT_STATUS_LOW ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_BAT_LOW;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_BAT_LOW);
-			}
-
-			if( ec_read(REG_BAT_STATUS) & BIT_BAT_STATUS_FULL ){
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] |= 1 << BIT_AC_BAT_BAT_FULL;
-			}else{
-				sci_device->sci_num_array[SCI_INDEX_AC_BAT] &= ~(1 << BIT_AC_BAT_BAT_FULL);
-			}
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_CHARGE_MODE, val[2] & BIT_BAT_CHARGE_STATUS_PRECHG);
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_STOP_CHARGE, val[3] & BIT_BAT_STATE_DISCHARGING);
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_BAT_LOW, val[0] & BIT_BAT_STATUS_LOW);
+			sci_ac_bat_bit(sci_device, BIT_AC_BAT_BAT_FULL, val[0] & BIT_BAT_STATUS_FULL);
 			break;
 		case	SCI_EVENT_NUM_DISPLAY_BRIGHTNESS :
-			val = ec_read(REG_DISPLAY_BRIGHTNESS);
-			if( (val == 0x00) || (val < sci_device->sci_init_value[0]) ){
+			sci_device->level = val[0];
+			if( (val[0] == 0x00) || (val[0] < sci_device->sci_init_value[0]) ){
 				sci_device->sci_num_array[SCI_INDEX_DISPLAY_BRIGHTNESS_DEC] = 1;
-				sci_device->sci_init_value[0] =  val;
-			}else if( (val == 0x08) || (val > sci_device->sci_init_value[0]) ){
+				sci_device->sci_init_value[0] =  val[0];
+			}else if( (val[0] == 0x08) || (val[0] > sci_device->sci_init_value[0]) ){
 				sci_device->sci_num_array[SCI_INDEX_DISPLAY_BRIGHTNESS_INC] = 1;
-				sci_device->sci_init_value[0] =  val;
+				sci_device->sci_init_value[0] =  val[0];
 			}
 			break;
 		case	SCI_EVENT_NUM_AUDIO_VOLUME :
-			val = ec_read(REG_AUDIO_VOLUME);
-			if( (val == 0x00) || (val < sci_device->sci_init_value[1]) ){
+			sci_device->level = val[0];
+			if( (val[0] == 0x00) || (val[0] < sci_device->sci_init_value[1]) ){
 				sci_device->sci_num_array[SCI_INDEX_AUDIO_VOLUME_DEC] = 1;
-				sci_device->sci_init_value[1] =  val;
-			}else if( (val == 0x0a) || (val > sci_device->sci_init_value[1]) ){
+				sci_device->sci_init_value[1] =  val[0];
+			}else if( (val[0] == 0x0a) || (val[0] > sci_device->sci_init_value[1]) ){
 				sci_device->sci_num_array[SCI_INDEX_AUDIO_VOLUME_INC] = 1;
-				sci_device->sci_init_value[1] = val;
+				sci_device->sci_init_value[1] = val[0];
 			}
 			break;
 		case	SCI_EVENT_NUM_WLAN :
-			sci_device->sci_num_array[SCI_INDEX_WLAN] = ec_read(REG_WLAN_STATUS);
+			sci_device->sci_num_array[SCI_INDEX_WLAN] = val[0];
 			break;
 		case	SCI_EVENT_NUM_AUDIO_MUTE :
-			sci_device->sci_num_array[SCI_INDEX_AUDIO_MUTE] = ec_read(REG_AUDIO_MUTE);
+			sci_device->sci_num_array[SCI_INDEX_AUDIO_MUTE] = val[0];
 			break;
 		case	SCI_EVENT_NUM_BLACK_SCREEN :
-			sci_device->sci_num_array[SCI_INDEX_BLACK_SCREEN] = ec_read(REG_DISPLAY_LCD);
+			sci_device->sci_num_array[SCI_INDEX_BLACK_SCREEN] = val[0];
 			break;
-			
-		default :
-			PRINTK_DBG(KERN_ERR "EC SCI : not supported SCI NUMBER.\n");
-			return -EINVAL;
-			break;		
 	}
 	
 	return 0;
@@ -789,65 +1254,240 @@ static int sci_parse_num(struct sci_device *sci_device)
 
 /***************************************************************/
 
+/* keys sent for the events, the brightness & volume ones by direction */
+static const unsigned short sci_input_keys[] = {
+	KEY_BRIGHTNESSUP, KEY_BRIGHTNESSDOWN, KEY_VOLUMEUP, KEY_VOLUMEDOWN,
+	KEY_MUTE, KEY_SLEEP, KEY_SWITCHVIDEOMODE, KEY_WLAN, KEY_CAMERA,
+	KEY_DISPLAY_OFF
+};
+
+static void sci_input_key(struct input_dev *input, unsigned int code)
+{
+	input_report_key(input, code, 1);
+	input_sync(input);
+	input_report_key(input, code, 0);
+	input_sync(input);
+}
+
 /*
- * sci_int_routine : sci main interrupt routine
- * we will do the query and get event number together
- * so the interrupt routine should be longer than 120us
- * now at least 3ms elpase for it.
+ * sci_input_report :
+ *	send the event parsed to the input subsystem, the hotkeys as a press
+ *	and release, the lid and crt as switches. the others have no code.
  */
-static irqreturn_t sci_int_routine(int irq, void *dev_id)
+static void sci_input_report(struct sci_device *sci_device)
 {
-	int ret;
-	
-	if(sci_device->irq != irq){
-		PRINTK_DBG(KERN_ERR "EC SCI :spurious irq.\n");
-		return IRQ_NONE;
+	struct input_dev *input = sci_device->input;
+	unsigned char *state = sci_device->sci_num_array;
+
+	switch(sci_device->sci_number){
+		case	SCI_EVENT_NUM_LID :
+			input_report_switch(input, SW_LID, !(state[SCI_INDEX_LID] & BIT_LID_DETECT_ON));
+			input_sync(input);
+			break;
+		case	SCI_EVENT_NUM_CRT_DETECT :
+			input_report_switch(input, SW_VIDEOOUT_INSERT,
+					!!(state[SCI_INDEX_CRT_DETECT] & BIT_CRT_DETECT_PLUG));
+			input_sync(input);
+			break;
+		case	SCI_EVENT_NUM_DISPLAY_TOGGLE :
+			sci_input_key(input, KEY_SWITCHVIDEOMODE);
+			break;
+		case	SCI_EVENT_NUM_SLEEP :
+			sci_input_key(input, KEY_SLEEP);
+			break;
+		case	SCI_EVENT_NUM_CAMERA :
+			sci_input_key(input, KEY_CAMERA);
+			break;
+		case	SCI_EVENT_NUM_DISPLAY_BRIGHTNESS :
+			if(state[SCI_INDEX_DISPLAY_BRIGHTNESS_INC])
+				sci_input_key(input, KEY_BRIGHTNESSUP);
+			else if(state[SCI_INDEX_DISPLAY_BRIGHTNESS_DEC])
+				sci_input_key(input, KEY_BRIGHTNESSDOWN);
+			break;
+		case	SCI_EVENT_NUM_AUDIO_VOLUME :
+			if(state[SCI_INDEX_AUDIO_VOLUME_INC])
+				sci_input_key(input, KEY_VOLUMEUP);
+			else if(state[SCI_INDEX_AUDIO_VOLUME_DEC])
+				sci_input_key(input, KEY_VOLUMEDOWN);
+			break;
+		case	SCI_EVENT_NUM_AUDIO_MUTE :
+			sci_input_key(input, KEY_MUTE);
+			break;
+		case	SCI_EVENT_NUM_WLAN :
+			sci_input_key(input, KEY_WLAN);
+			break;
+		case	SCI_EVENT_NUM_BLACK_SCREEN :
+			sci_input_key(input, KEY_DISPLAY_OFF);
+			break;
 	}
-	PRINTK_DBG("liujl : debug entering int....\n");
+}
 
-	/* query the event number */
-	ret = sci_query_event_num();
-	if(ret < 0){
-		PRINTK_DBG("ret 1: %d\n", ret);
-		return IRQ_NONE;
+/* register the input device, the switches start from the state of ec */
+static int sci_input_init(struct sci_device *sci_device, struct pci_dev *pdev)
+{
+	struct input_dev *input;
+	unsigned char *state = sci_device->sci_num_array;
+	int i;
+	int ret;
+
+	input = input_allocate_device();
+	if(input == NULL)
+		return -ENOMEM;
+
+	input->name = "EC SCI hotkeys";
+	input->phys = EC_SCI_DEV "/input0";
+	input->id.bustype = BUS_HOST;
+	input->dev.parent = &pdev->dev;
+
+	for(i = 0; i < ARRAY_SIZE(sci_input_keys); i++)
+		input_set_capability(input, EV_KEY, sci_input_keys[i]);
+	input_set_capability(input, EV_SW, SW_LID);
+	input_set_capability(input, EV_SW, SW_VIDEOOUT_INSERT);
+
+	ret = input_register_device(input);
+	if(ret){
+		input_free_device(input);
+		return ret;
 	}
+	input_report_switch(input, SW_LID, !(state[SCI_INDEX_LID] & BIT_LID_DETECT_ON));
+	input_report_switch(input, SW_VIDEOOUT_INSERT,
+			!!(state[SCI_INDEX_CRT_DETECT] & BIT_CRT_DETECT_PLUG));
+	input_sync(input);
+	sci_device->input = input;
+
+	return 0;
+}
 
+/***************************************************************/
+
+/*
+ * sci_event_handler :
+ *	the bottom half of the sci interrupt, query the event number from ec
+ *	and parse it, at least 3ms elapse for it. the GPIO27 event masked by
+ *	sci_int_routine is enabled again at last.
+ */
+static irqreturn_t sci_event_handler(int irq, void *dev_id)
+{
+	u64 query_ns;
+	int ret;
+
+	/* query the event number */
 	ret = sci_get_event_num();
 	if(ret < 0){
-		PRINTK_DBG("ret 2: %d\n", ret);
-		return IRQ_NONE;
+		PRINTK_DBG("query event num : %d\n", ret);
+		sci_stat_inc(query_timeout);
+		goto out;
 	}
 	sci_device->sci_number = ret;
+	sci_stat_event(sci_device->sci_number, SCI_STAT_QUERY, sci_device->irq_ns);
+	query_ns = ktime_to_ns(ktime_get());
 	
 	PRINTK_DBG(KERN_INFO "sci_number: 0x%x\n", sci_device->sci_number);
 
 	/* parse the event number and wake the queue */
-	if( (sci_device->sci_number != 0x00) 
-		&& (sci_device->sci_number != 0xff) ){
+	if(sci_device->sci_number == 0x00){
+		sci_stat_inc(number_00);
+	}else if(sci_device->sci_number == 0xff){
+		sci_stat_inc(number_ff);
+	}else{
 		ret = sci_parse_num(sci_device);
 		PRINTK_DBG("ret 3: %d\n", ret);
-		if(!ret)
-			sci_device->irq_data = 1;
-		else
-			sci_device->irq_data = 0;			
+		if(!ret){
+			sci_stat_event(sci_device->sci_number, SCI_STAT_PARSE, query_ns);
+			sci_input_report(sci_device);
+			sci_queue_event(sci_device);
+		}else{
+			sci_stat_inc(parse_failed);
+		}
 
-		wake_up_interruptible(&(sci_device->wq));
 		PRINTK_DBG("interrupitble\n");
 	}
 
+out :
+	outl(GPIO27_EVNT_ON, sci_device->gpio_base | GPIOH_EVNT_EN);
+
 	return IRQ_HANDLED;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+static void sci_event_work(struct work_struct *work)
+{
+	sci_event_handler(sci_device->irq, sci_device);
+}
+#endif
+
+/*
+ * sci_int_routine : sci main interrupt routine
+ * the event is only masked here, so the interrupt is not raised again
+ * before ec is queried, and the query is left to the bottom half.
+ */
+static irqreturn_t sci_int_routine(int irq, void *dev_id)
+{
+	u64 entry_ns = ktime_to_ns(ktime_get());
+
+	if(sci_device->irq != irq){
+		PRINTK_DBG(KERN_ERR "EC SCI :spurious irq.\n");
+		return IRQ_NONE;
+	}
+	/* the shared line is raised by the other device, not GPIO27 */
+	if( !(inl(sci_device->gpio_base | GPIOH_POSEDGE_STS) & GPIO27_EDGE_BIT) ){
+		sci_stat_inc(spurious_irq);
+		return IRQ_NONE;
+	}
+	PRINTK_DBG("liujl : debug entering int....\n");
+
+	outl(GPIO27_EDGE_BIT, sci_device->gpio_base | GPIOH_POSEDGE_STS);
+	outl(GPIO27_EVNT_OFF, sci_device->gpio_base | GPIOH_EVNT_EN);
+	/* the event is masked, no other entry until the bottom half is over */
+	sci_device->irq_ns = entry_ns;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	queue_work(sci_device->event_wq, &sci_device->event_work);
+	sci_stat_hard_irq(entry_ns);
+	return IRQ_HANDLED;
+#else
+	sci_stat_hard_irq(entry_ns);
+	return IRQ_WAKE_THREAD;
+#endif
+}
+
 /************************************************************/
 
+/* the reader of the file gets the events from now on */
 static int sci_open(struct inode * inode, struct file * filp)
 {
+	struct sci_reader *reader;
+	unsigned long flags;
+
+	if(sci_device == NULL)
+		return -ENODEV;
+	reader = kmalloc(sizeof(struct sci_reader), GFP_KERNEL);
+	if(reader == NULL)
+		return -ENOMEM;
+	reader->mask = SCI_EVENT_MASK_ALL;
+	reader->lost = 0;
+	mutex_init(&reader->lock);
+	init_waitqueue_head(&reader->wq);
+	filp->private_data = reader;
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	reader->seq = sci_device->head;
+	list_add(&reader->list, &sci_device->readers);
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+
 	PRINTK_DBG(KERN_INFO "SCI : open ok.\n");
 	return 0;
 }
 
 static int sci_release(struct inode * inode, struct file * filp)
 {
+	struct sci_reader *reader = filp->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&sci_device->lock, flags);
+	list_del(&reader->list);
+	spin_unlock_irqrestore(&sci_device->lock, flags);
+	kfree(reader);
 	PRINTK_DBG(KERN_INFO "SCI : close ok.\n");
 	return 0;
 }
@@ -857,11 +1497,12 @@ static int sci_release(struct inode * inode, struct file * filp)
  */
 static unsigned int sci_poll(struct file *fp, poll_table *wait)
 {
+	struct sci_reader *reader = fp->private_data;
 	int mask = 0;
 
 	//printk("current task %p\n", current);
-	poll_wait(fp, &(sci_device->wq), wait);
-	if(sci_device->irq_data){
+	poll_wait(fp, &reader->wq, wait);
+	if(sci_reader_pending(reader)){
 		//printk("current task 1 %p\n", current);
 		mask = POLLIN | POLLRDNORM;
 	}
@@ -869,9 +1510,45 @@ static unsigned int sci_poll(struct file *fp, poll_table *wait)
 	return mask;
 }
 
-static int sci_ioctl(struct inode *inode, struct file *filp, unsigned long cmd, unsigned long arg)
+/*
+ * sci_read :
+ *	read the event records in binary, struct sci_event_record each.
+ *	wait for the first one, then the records pending are read as many
+ *	as the buffer holds.
+ */
+static ssize_t sci_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+{
+	struct sci_reader *reader = filp->private_data;
+	struct sci_event_record rec;
+	ssize_t count = 0;
+	int ret;
+
+	if(len < sizeof(struct sci_event_record))
+		return -EINVAL;
+
+	if(mutex_lock_interruptible(&reader->lock))
+		return -ERESTARTSYS;
+	ret = sci_wait_record(reader, &rec, filp->f_flags & O_NONBLOCK);
+	while(ret == 0){
+		if(copy_to_user(buf + count, &rec, sizeof(struct sci_event_record))){
+			ret = -EFAULT;
+			break;
+		}
+		count += sizeof(struct sci_event_record);
+		if( (len - count < sizeof(struct sci_event_record))
+			|| !sci_reader_next(reader, &rec) )
+			break;
+	}
+	mutex_unlock(&reader->lock);
+
+	return count ? count : ret;
+}
+
+static int sci_ioctl(struct inode *inode, struct file *filp, unsigned int cmd, unsigned long arg)
 {
 	void __user *ptr = (void __user *)arg;
+	struct sci_reader *reader = filp->private_data;
+	u32 mask;
 	int ret = 0;
 
 	switch(cmd){
@@ -892,6 +1569,17 @@ static int sci_ioctl(struct inode *inode, struct file *filp, unsigned long cmd,
 				return -EFAULT;
 			}
 			break;
+		case	IOCTL_SCI_SET_MASK :
+			if(get_user(mask, (u32 __user *)ptr))
+				return -EFAULT;
+			reader->mask = mask;
+			/* the events pending may be subscribed now */
+			wake_up_interruptible(&reader->wq);
+			break;
+		case	IOCTL_SCI_GET_MASK :
+			if(put_user(reader->mask, (u32 __user *)ptr))
+				return -EFAULT;
+			break;
 		default :
 			break;
 	}
@@ -911,9 +1599,10 @@ static const struct file_operations sci_fops = {
 #ifdef	CONFIG_64BIT
 	.compat_ioctl	= sci_compat_ioctl,
 #else
-	.ioclt		= sci_ioctl,
+	.ioctl		= sci_ioctl,
 #endif
 	.open		= sci_open,
+	.read		= sci_read,
 	.poll		= sci_poll,
 	.release	= sci_release,
 };
@@ -956,7 +1645,7 @@ static int sci_low_level_init(struct sci_device *scidev)
 	/* set gpio native registers and msrs for GPIO27 SCI EVENT PIN 
 	 * gpio :
 	 *	input, pull-up, no-invert, event-count and value 0, 
-	 *	no-filter, no edge mode
+	 *	no-filter, positive edge mode
 	 *	gpio27 map to Virtual gpio0
 	 * msr :
 	 *	no primary and lpc
@@ -975,7 +1664,7 @@ static int sci_low_level_init(struct sci_device *scidev)
 	local_irq_restore(flags);
 	
 	/* set gpio27 as sci interrupt : 
-	 * input, pull-up, no-fliter, no-negedge, invert
+	 * input, pull-up, no-fliter, posedge, no-negedge, invert
 	 * the sci event is just about 120us
 	 */
 	asm(".set noreorder\n");
@@ -983,6 +1672,9 @@ static int sci_low_level_init(struct sci_device *scidev)
 	outl( 0x00000800, (gpio_base | 0xA0) );
 	// revert the input
 	outl( 0x00000800, (gpio_base | 0xA4) );
+	// posedge detect enable and clear the stale status
+	outl( GPIO27_EDGE_BIT, (gpio_base | GPIOH_POSEDGE_EN) );
+	outl( GPIO27_EDGE_BIT, (gpio_base | GPIOH_POSEDGE_STS) );
 	// event-int enable
 	outl( 0x00000800, (gpio_base | 0xB8) );
 	asm(".set reorder\n");
@@ -1006,18 +1698,21 @@ static int __devinit sci_pci_init(struct pci_dev *pdev, const struct pci_device_
 		PRINTK_DBG(KERN_ERR "EC SCI : get memory for sci_device failed.\n");
 		return -ENOMEM;
 	}
-	init_waitqueue_head(&(sci_device->wq));
+	INIT_LIST_HEAD(&sci_device->readers);
 	spin_lock_init(&sci_device->lock);
 	sci_device->irq	= SCI_IRQ_NUM;
-	sci_device->irq_data = 0x00;
+	sci_device->head = 0;
+	sci_device->pending_valid = 0;
+	setup_timer(&sci_device->coalesce_timer, sci_coalesce_timeout, 0);
+	atomic_set(&sci_device->overflow, 0);
+	for(i = 0; i < SCI_RING_SIZE; i++)
+		sci_device->ring[i].seq = i - SCI_RING_SIZE;
 	sci_device->sci_number = 0x00;
 	strcpy(sci_device->name, EC_SCI_DEV);
 
-	sci_device->sci_init_value[0] = ec_read(REG_DISPLAY_BRIGHTNESS);
-	sci_device->sci_init_value[1] = ec_read(REG_AUDIO_VOLUME);
-
 	for(i = 0; i < SCI_MAX_EVENT_COUNT; i++)
 		sci_device->sci_num_array[i] = 0x00;
+	sci_init_state(sci_device);
 
 	/* enable pci device and get the GPIO resources */
 	ret = pci_enable_device(pdev);
@@ -1049,12 +1744,34 @@ static int __devinit sci_pci_init(struct pci_dev *pdev, const struct pci_device_
 		goto out_irq;
 	}
 	
+	/* the input device is reported from the bottom half */
+	ret = sci_input_init(sci_device, pdev);
+	if(ret){
+		printk(KERN_ERR "EC SCI : register input device failed.\n");
+		goto out_irq;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	sci_device->event_wq = create_singlethread_workqueue(EC_SCI_DEV);
+	if(sci_device->event_wq == NULL){
+		printk(KERN_ERR "EC SCI : create workqueue failed.\n");
+		ret = -ENOMEM;
+		goto out_wq;
+	}
+	INIT_WORK(&sci_device->event_work, sci_event_work);
+#endif
+
 	/* alloc the interrupt for sci not pci */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
 	ret = request_irq(sci_device->irq, sci_int_routine, IRQF_SHARED, sci_device->name, sci_device);
+#else
+	ret = request_threaded_irq(sci_device->irq, sci_int_routine, sci_event_handler,
+			IRQF_SHARED, sci_device->name, sci_device);
+#endif
 	if(ret){
 		printk(KERN_ERR "EC SCI : request irq %d failed.\n", sci_device->irq);
 		ret = -EFAULT;
-		goto out_irq;
+		goto out_wq;
 	}
 
 	/* register the misc device */
@@ -1071,6 +1788,16 @@ static int __devinit sci_pci_init(struct pci_dev *pdev, const struct pci_device_
 	
 out_misc :
 	free_irq(sci_device->irq, sci_device);
+out_wq :
+	/* the same order as sci_pci_remove, the bottom half goes first */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	if(sci_device->event_wq)
+		destroy_workqueue(sci_device->event_wq);
+#endif
+	/* no bottom half can arm the timer again */
+	del_timer_sync(&sci_device->coalesce_timer);
+	sci_device->pending_valid = 0;
+	input_unregister_device(sci_device->input);
 out_irq :
 	release_region(sci_device->gpio_base, sci_device->gpio_size);
 out_resource :
@@ -1085,6 +1812,15 @@ static void __devexit sci_pci_remove(struct pci_dev *pdev)
 {
 	misc_deregister(&sci_dev);
 	free_irq(sci_device->irq, sci_device);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+	/* the pending bottom half is finished by destroying */
+	destroy_workqueue(sci_device->event_wq);
+#endif
+	/* the bottom half may arm the timer until it is finished,
+	 * the event merged is dropped for nobody reads it any more */
+	del_timer_sync(&sci_device->coalesce_timer);
+	sci_device->pending_valid = 0;
+	input_unregister_device(sci_device->input);
 	release_region(sci_device->gpio_base, sci_device->gpio_size);
 	pci_disable_device(pdev);
 	kfree(sci_device);
@@ -1127,6 +1863,13 @@ static int __init sci_init(void)
 #endif
 		return ret;
 	}
+
+#ifdef	CONFIG_DEBUG_FS
+	/* only for the statistics, the driver works without it */
+	sci_debugfs_dir = debugfs_create_dir(EC_SCI_DEV, NULL);
+	if(sci_debugfs_dir)
+		debugfs_create_file("stats", S_IWUSR | S_IRUGO, sci_debugfs_dir, NULL, &sci_stats_fops);
+#endif
 	
 	printk(KERN_INFO "SCI event handler on KB3310B Embedded Controller init.\n");
 
@@ -1135,6 +1878,9 @@ static int __init sci_init(void)
 
 static void __exit sci_exit(void)
 {
+#ifdef	CONFIG_DEBUG_FS
+	debugfs_remove_recursive(sci_debugfs_dir);
+#endif
 #ifdef	CONFIG_PROC_FS
 	remove_proc_entry(EC_SCI_DEV, NULL);
 #endif